@@ -0,0 +1,6 @@
+# display.show() animation: a new image every 50ms (about 5 simulated seconds).
+from microbit import *
+
+for i in range(8):
+    display.show(Image.ALL_CLOCKS, delay=50)
+display.clear()
@@ -0,0 +1,8 @@
+# A tight arithmetic loop with no I/O, so the VM never sleeps.
+from microbit import *
+
+total = 0
+values = [3, 1, 4, 1, 5, 9, 2, 6]
+for i in range(20000):
+    total = (total + values[i % 8] * i) % 1000003
+print(total)
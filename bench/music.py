@@ -0,0 +1,11 @@
+# Music and PWM: a tune on pin 0, a frequency sweep, then a duty cycle sweep on pin 1.
+from microbit import *
+import music
+
+music.play(music.BIRTHDAY)
+for frequency in range(200, 2000, 50):
+    music.pitch(frequency, 20)
+pin1.set_analog_period(10)
+for i in range(200):
+    pin1.write_analog(i * 5 % 1024)
+    sleep(10)
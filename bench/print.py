@@ -0,0 +1,5 @@
+# Serial output as fast as the VM can produce it.
+from microbit import *
+
+for i in range(2000):
+    print('line', i, i * i)
@@ -0,0 +1,17 @@
+# Radio ping-pong with radio_pong.py on a second board (the driver relays frames between them).
+# Resends the current ping every 100ms until the matching pong arrives.
+from microbit import *
+import radio
+
+radio.on()
+for count in range(50):
+    ping = 'ping %d' % count
+    pong = 'pong %d' % count
+    radio.send(ping)
+    sent = running_time()
+    while radio.receive() != pong:
+        if running_time() - sent > 100:
+            radio.send(ping)
+            sent = running_time()
+        sleep(1)
+print('round trips', count + 1)
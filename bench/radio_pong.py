@@ -0,0 +1,13 @@
+# Radio ping-pong with radio_ping.py on a second board: answers every ping until the last one.
+from microbit import *
+import radio
+
+radio.on()
+while True:
+    message = radio.receive()
+    if message and message.startswith('ping '):
+        count = int(message[5:])
+        radio.send('pong %d' % count)
+        if count == 49:
+            break
+    sleep(1)
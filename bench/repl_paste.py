@@ -0,0 +1,21 @@
+# Pasted into the REPL in paste mode (Ctrl-E ... Ctrl-D), a chunk at a time, like an editor's
+# "send to micro:bit". Prints the marker the driver waits for.
+from microbit import *
+
+
+def fib(n):
+    a, b = 0, 1
+    for i in range(n):
+        a, b = b, a + b
+    return a
+
+
+squares = [i * i for i in range(100)]
+words = {}
+for word in 'the quick brown fox jumps over the lazy dog the end'.split():
+    words[word] = words.get(word, 0) + 1
+for i in range(10):
+    display.set_pixel(i % 5, i // 5, 9)
+print(fib(30), sum(squares), words['the'])
+# Split so that the echoed paste doesn't contain the marker.
+print('bench', 'done')
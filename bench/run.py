@@ -0,0 +1,369 @@
+#!/usr/bin/python3
+
+# vim: set et nosi ai ts=2 sts=2 sw=2:
+# coding: utf-8
+
+# Run the benchmark programs in this directory against a simulator build, in normal (real-time)
+# and fast (-f) mode, and print one JSON object per benchmark and mode:
+#   bench/run.py build/x86-linux-native-32bit/source/microbit-micropython > results.jsonl
+# See "Benchmarks" in README.md for the fields.
+
+from __future__ import absolute_import, print_function, unicode_literals
+
+import argparse
+import fcntl
+import json
+import os
+import select
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# Each benchmark runs one program per board (None for the bare REPL). Boards run at the same time,
+# with radio frames relayed between them.
+BENCHMARKS = [
+    {'name': 'scroll', 'boards': ['scroll.py']},
+    {'name': 'animation', 'boards': ['animation.py']},
+    {'name': 'arithmetic', 'boards': ['arithmetic.py']},
+    {'name': 'print', 'boards': ['print.py']},
+    {'name': 'radio', 'boards': ['radio_ping.py', 'radio_pong.py']},
+    {'name': 'music', 'boards': ['music.py']},
+    {'name': 'sensors', 'boards': ['sensors.py'], 'accelerometer': True},
+    {'name': 'repl_paste', 'boards': [None], 'paste': 'repl_paste.py'},
+]
+
+MODES = {
+    'normal': [],
+    'fast': ['-f'],
+}
+
+MILLISECONDS_PER_MACRO_TICK = 6
+
+# Paste a chunk at a time, like an editor would, so the firmware's serial buffer keeps up. The run
+# ends when the pasted code prints the marker (the simulator then gets PASTE_EXIT_WAIT seconds to
+# shut down after a soft reboot).
+PASTE_CHUNK = 32
+PASTE_INTERVAL = 0.02
+PASTE_MARKER = b'bench done'
+PASTE_EXIT_WAIT = 2
+
+ACCELEROMETER_INTERVAL = 0.1
+
+
+class Board(object):
+  def __init__(self, simulator, program, mode_flags, workdir, strace_path=None):
+    self.program = program
+    self.fast = '-f' in mode_flags
+
+    # Pipes to send client events and receive updates (must be inheritable by the simulator).
+    self._client_events_pipe = os.pipe()
+    self._device_updates_pipe = os.pipe()
+    env = dict(os.environ)
+    env['GROK_CLIENT_PIPE'] = str(self._client_events_pipe[0])
+    env['GROK_UPDATES_PIPE'] = str(self._device_updates_pipe[1])
+
+    args = [simulator] + mode_flags
+    if program:
+      args.append(os.path.join(BENCH_DIR, program))
+    if strace_path:
+      args = ['strace', '-f', '-c', '-o', strace_path] + args
+
+    self.process = subprocess.Popen(
+        args=args, env=env, cwd=workdir, pass_fds=(self._client_events_pipe[0],
+                                                  self._device_updates_pipe[1]),
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    os.close(self._client_events_pipe[0])
+    os.close(self._device_updates_pipe[1])
+
+    self.updates_fd = self._device_updates_pipe[0]
+    self.stdout_fd = self.process.stdout.fileno()
+    for fd in (self.updates_fd, self.stdout_fd):
+      fcntl.fcntl(fd, fcntl.F_SETFL, fcntl.fcntl(fd, fcntl.F_GETFL) | os.O_NONBLOCK)
+
+    self.update_bytes = 0
+    self.serial_bytes = 0
+    self.serial_tail = b''
+    self.ticks = 0
+    self.bye_ticks = None
+    self.stats = None
+    self.rusage = None
+    self.status = None
+    self._partial = b''
+
+  def event(self, event_type, data):
+    line = json.dumps([{'type': event_type, 'data': data}]) + '\n'
+    try:
+      os.write(self._client_events_pipe[1], line.encode('utf-8'))
+    except OSError:
+      # The simulator has exited.
+      pass
+
+  def serial(self, data):
+    try:
+      self.process.stdin.write(data)
+      self.process.stdin.flush()
+    except (OSError, ValueError):
+      pass
+
+  def read_updates(self):
+    # Returns the update records read so far (None once the simulator has closed the pipe).
+    records = []
+    try:
+      data = os.read(self.updates_fd, 65536)
+    except BlockingIOError:
+      return records
+    if not data:
+      return None
+    self.update_bytes += len(data)
+    lines = (self._partial + data).split(b'\n')
+    self._partial = lines.pop()
+    for line in lines:
+      if not line.strip():
+        continue
+      try:
+        records.extend(json.loads(line.decode('utf-8')))
+      except ValueError:
+        continue
+    for record in records:
+      self.ticks = max(self.ticks, record.get('ticks', 0))
+      if record.get('type') == 'microbit_bye':
+        self.bye_ticks = record['ticks']
+      elif record.get('type') == 'microbit_stats':
+        self.stats = record['data']
+    if records and self.fast:
+      # Fast mode suspends after device updates until the client resumes it.
+      self.event('resume', {})
+    return records
+
+  def read_serial(self):
+    # Returns the number of bytes read (None once the simulator has closed stdout).
+    try:
+      data = os.read(self.stdout_fd, 65536)
+    except BlockingIOError:
+      return 0
+    if not data:
+      return None
+    self.serial_bytes += len(data)
+    self.serial_tail = (self.serial_tail + data)[-256:]
+    return len(data)
+
+  def poll(self):
+    # Returns True once the simulator has exited (and records its resource usage).
+    if self.status is None:
+      pid, status, rusage = os.wait4(self.process.pid, os.WNOHANG)
+      if pid == self.process.pid:
+        self.status = os.WEXITSTATUS(status) if os.WIFEXITED(status) else -os.WTERMSIG(status)
+        self.rusage = rusage
+        self.process.returncode = self.status
+    return self.status is not None
+
+  def kill(self):
+    if self.status is None:
+      self.process.kill()
+
+  def wait(self):
+    while not self.poll():
+      time.sleep(0.01)
+
+  def close(self):
+    for fd in (self.updates_fd, self._client_events_pipe[1]):
+      os.close(fd)
+    self.process.stdin.close()
+    self.process.stdout.close()
+
+
+def paste_chunks(path):
+  with open(os.path.join(BENCH_DIR, path), 'rb') as f:
+    source = f.read()
+  data = b'\x05' + source + b'\x04'
+  return [data[i:i + PASTE_CHUNK] for i in range(0, len(data), PASTE_CHUNK)]
+
+
+def run_once(simulator, benchmark, mode, timeout, strace_dir=None):
+  workdir = tempfile.mkdtemp()
+  boards = []
+  try:
+    for i, program in enumerate(benchmark['boards']):
+      strace_path = os.path.join(strace_dir, 'strace-{}'.format(i)) if strace_dir else None
+      boards.append(Board(simulator, program, MODES[mode], workdir, strace_path))
+
+    start = time.time()
+    timed_out = False
+    chunks = paste_chunks(benchmark['paste']) if 'paste' in benchmark else None
+    pasting = False
+    paste_done_at = None
+    next_paste = 0
+    next_accelerometer = start
+    accelerometer_step = 0
+
+    fds = {}
+    for board in boards:
+      fds[board.updates_fd] = board
+      fds[board.stdout_fd] = board
+    poller = select.epoll()
+    for fd in fds:
+      poller.register(fd, select.EPOLLIN)
+
+    while not all(board.poll() for board in boards):
+      now = time.time()
+      if now - start > timeout:
+        timed_out = True
+        break
+      if paste_done_at is not None and now - paste_done_at > PASTE_EXIT_WAIT:
+        break
+
+      for fd, unused_events in poller.poll(0.01):
+        board = fds[fd]
+        if fd == board.stdout_fd:
+          if board.read_serial() is None:
+            poller.unregister(fd)
+          continue
+        records = board.read_updates()
+        if records is None:
+          poller.unregister(fd)
+          continue
+        for record in records:
+          if record.get('type') == 'microbit_radio_tx':
+            for other in boards:
+              if other is not board:
+                other.event('microbit_radio_rx', record['data'])
+
+      if chunks is not None:
+        board = boards[0]
+        if not pasting and b'>>> ' in board.serial_tail:
+          pasting = True
+        if pasting and chunks and now >= next_paste:
+          board.serial(chunks.pop(0))
+          next_paste = now + PASTE_INTERVAL
+        if not chunks and paste_done_at is None and PASTE_MARKER in board.serial_tail:
+          # Soft reboot from the REPL, which shuts the simulator down.
+          board.serial(b'\x04')
+          paste_done_at = now
+
+      if benchmark.get('accelerometer') and now >= next_accelerometer:
+        accelerometer_step += 1
+        boards[0].event('accelerometer', {
+            'x': (accelerometer_step * 37) % 2048 - 1024,
+            'y': (accelerometer_step * 53) % 2048 - 1024,
+            'z': -1024,
+        })
+        next_accelerometer = now + ACCELEROMETER_INTERVAL
+
+    wall = (paste_done_at or time.time()) - start
+
+    poller.close()
+    for board in boards:
+      board.kill()
+      board.wait()
+      while board.read_updates():
+        pass
+      while board.read_serial():
+        pass
+
+    ticks = max(board.bye_ticks if board.bye_ticks is not None else board.ticks
+                for board in boards)
+    simulated = ticks * MILLISECONDS_PER_MACRO_TICK / 1000.0
+    user = sum(board.rusage.ru_utime for board in boards)
+    system = sum(board.rusage.ru_stime for board in boards)
+    return {
+        'benchmark': benchmark['name'],
+        'mode': mode,
+        'simulated_s': round(simulated, 3),
+        'wall_s': round(wall, 3),
+        'simulated_per_wall_s': round(simulated / wall, 3) if wall else None,
+        'cpu_s': round(user + system, 3),
+        'user_s': round(user, 3),
+        'system_s': round(system, 3),
+        'context_switches': sum(board.rusage.ru_nvcsw + board.rusage.ru_nivcsw for board in boards),
+        'update_bytes': sum(board.update_bytes for board in boards),
+        'serial_bytes': sum(board.serial_bytes for board in boards),
+        # The largest of any one process (the simulator or the run it forks).
+        'peak_rss_kb': max(board.rusage.ru_maxrss for board in boards),
+        'exit_status': [board.status for board in boards],
+        'timed_out': timed_out,
+        'simulator_stats': [board.stats for board in boards],
+    }
+  finally:
+    for board in boards:
+      board.kill()
+      board.wait()
+      board.close()
+    shutil.rmtree(workdir, ignore_errors=True)
+
+
+def count_syscalls(strace_dir):
+  # Sum the calls column of each strace -c summary.
+  total = 0
+  for name in os.listdir(strace_dir):
+    with open(os.path.join(strace_dir, name)) as f:
+      for line in f:
+        fields = line.split()
+        if len(fields) >= 5 and fields[-1] != 'total' and fields[3].isdigit():
+          total += int(fields[3])
+  return total
+
+
+def run_benchmark(simulator, benchmark, mode, args):
+  results = [run_once(simulator, benchmark, mode, args.timeout) for i in range(args.runs)]
+  # Report the run with the median wall time.
+  results.sort(key=lambda result: result['wall_s'])
+  result = results[len(results) // 2]
+  result['runs'] = args.runs
+
+  result['syscalls'] = None
+  if args.syscalls:
+    # Counted in a separate run, since tracing slows the simulator down.
+    strace_dir = tempfile.mkdtemp()
+    try:
+      run_once(simulator, benchmark, mode, args.timeout, strace_dir)
+      result['syscalls'] = count_syscalls(strace_dir)
+    finally:
+      shutil.rmtree(strace_dir, ignore_errors=True)
+  return result
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Run the simulator benchmark suite.')
+  parser.add_argument('simulator', help='path to the microbit-micropython binary')
+  parser.add_argument('--only', help='comma-separated benchmarks to run (default: all)')
+  parser.add_argument('--modes', default='normal,fast',
+                      help='comma-separated modes to run (default: normal,fast)')
+  parser.add_argument('--runs', type=int, default=1,
+                      help='runs of each benchmark (the median by wall time is reported)')
+  parser.add_argument('--timeout', type=float, default=120,
+                      help='seconds before a run is killed (default: 120)')
+  parser.add_argument('--syscalls', action='store_true',
+                      help='also count system calls, in an extra run under strace')
+  args = parser.parse_args()
+
+  simulator = os.path.abspath(args.simulator)
+  if args.syscalls and not shutil.which('strace'):
+    print('strace not found.', file=sys.stderr)
+    return 1
+
+  names = args.only.split(',') if args.only else [b['name'] for b in BENCHMARKS]
+  modes = args.modes.split(',')
+  for mode in modes:
+    if mode not in MODES:
+      print('Unknown mode: {}'.format(mode), file=sys.stderr)
+      return 1
+
+  for benchmark in BENCHMARKS:
+    if benchmark['name'] not in names:
+      continue
+    for mode in modes:
+      print('{} ({})...'.format(benchmark['name'], mode), file=sys.stderr)
+      result = run_benchmark(simulator, benchmark, mode, args)
+      print(json.dumps(result, sort_keys=True))
+      sys.stdout.flush()
+  return 0
+
+
+if __name__ == '__main__':
+  signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+  sys.exit(main())
@@ -0,0 +1,5 @@
+# Scrolling text: the display is redrawn every column (about 5 simulated seconds).
+from microbit import *
+
+for i in range(2):
+    display.scroll('Hello, World!', delay=60)
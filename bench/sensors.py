@@ -0,0 +1,12 @@
+# Sensor polling: reads the accelerometer, compass, temperature, buttons and an analog pin every
+# 10ms (the driver also sends a new accelerometer reading about every 100ms).
+from microbit import *
+
+total = 0
+for i in range(500):
+    total += accelerometer.get_x() + accelerometer.get_y() + accelerometer.get_z()
+    total += compass.get_x() + temperature() + pin0.read_analog()
+    if button_a.is_pressed() or accelerometer.was_gesture('shake'):
+        total += 1
+    sleep(10)
+print(total)
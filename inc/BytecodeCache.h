@@ -0,0 +1,27 @@
+#ifndef __BYTECODE_CACHE_H
+#define __BYTECODE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// On-disk cache of the compiled form of the initial script (see -b in README.md). Entries are
+// keyed by a hash of the script source and the firmware build, since the bytecode format is
+// specific to the MicroPython build.
+
+// Defined by firmware whose mprun.c calls simulated_dal_get_compiled_script and
+// simulated_dal_store_compiled_script (see mpconfigport-simulated.h). It's weak so that firmware
+// without bytecode cache support still links, and -b is refused if it's missing.
+extern "C" void simulated_dal_micropy_compiled_script_support() __attribute__((weak));
+
+// Set the cache directory (created if necessary) and compute the key for script.
+bool bytecode_cache_init(const char* dir, const char* script);
+bool bytecode_cache_enabled();
+
+// Look up the compiled script, returning the bytecode and how long it originally took to compile.
+bool bytecode_cache_load(std::string* bytecode, uint32_t* compile_us);
+// Store freshly compiled bytecode (atomically, so concurrent simulators can share a cache).
+void bytecode_cache_store(const void* bytecode, size_t len, uint32_t compile_us);
+
+#endif
@@ -13,11 +13,36 @@
 
 const size_t FLASH_ROM_SIZE = 200 * 1024;
 const size_t MAX_SCRIPT_SIZE = 100 * 1024;
+const size_t FLASH_PAGE_SIZE = 4096;
 
 extern uint8_t* flash_rom;
 
+// The firmware addresses flash with 32-bit addresses (as on the nRF51, e.g. in nrf_nvmc_* and
+// __etext). These translate between them and host pointers as base plus offset, so they stay
+// correct when host pointers are 64 bits. Main.cpp also maps flash below 4GB on 64-bit hosts, so
+// firmware code that casts the addresses straight to pointers keeps working.
+inline uint32_t
+flash_address(const void* p) {
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(p));
+}
+
+inline uint8_t*
+flash_pointer(uint32_t addr) {
+  return flash_rom + static_cast<uint32_t>(addr - flash_address(flash_rom));
+}
+
+// Writes to flash (via nrf_nvmc_*) are tracked per page when it's backed by a file (see -F in
+// README.md), so that nvmc_tick() can write them back in batches.
+void set_flash_file_backed(bool backed);
+// Write back dirty pages (waiting for the writes to complete if wait is set).
+void sync_flash(bool wait);
+
 void serial_add_byte(uint8_t c);
 
+// Called (on the code thread, holding code_lock) with every byte written to the serial console.
+typedef void (*serial_output_observer_t)(uint8_t c);
+void set_serial_output_observer(serial_output_observer_t observer);
+
 enum GpioPinState {
   GPIO_PIN_OUTPUT_LOW = 0,
   GPIO_PIN_OUTPUT_HIGH,
@@ -101,19 +126,28 @@ void get_magnetometer(int32_t* x, int32_t* y, int32_t* z);
 void set_temperature(int32_t t);
 void get_temperature(int32_t* t);
 
+// Every source of randomness in the simulator (random numbers, floating pins, etc) comes from a
+// single PRNG, so a given seed always produces the same run.
+void set_entropy_seed(uint64_t seed);
+uint32_t get_entropy();
+
 void set_random_state(int32_t next, int32_t repeat);
+bool get_random_state(int32_t* next, int32_t* remaining);
 void set_random_seed(uint32_t seed);
 uint32_t get_random();
 bool has_exceeded_random_call_limit();
 void set_random_choice(int32_t count, const char* result);
 bool get_random_choice(int32_t* count, const char** result);
 
+// The nRF51 radio's length field is a single byte, so no frame can be longer than this.
+const size_t RADIO_MAX_FRAME_SIZE = 256;
+
 struct simulator_radio_frame_t {
   simulator_radio_frame_t()
       : len(0), channel(7), base0(0x75626974), prefix0(0), data_rate(RADIO_MODE_MODE_Nrf_1Mbit) {
   }
   uint32_t len;
-  char data[2048];
+  char data[RADIO_MAX_FRAME_SIZE];
   uint8_t channel;
   uint32_t base0;
   uint8_t prefix0;
@@ -139,6 +173,8 @@ bool get_reset_flag();
 
 void set_panic_flag();
 bool get_panic_flag();
+// Stop the VM after setting the panic flag (Main.cpp). Caller must hold code_lock.
+void halt_on_panic();
 
 void set_disconnect_flag();
 bool get_disconnect_flag();
@@ -153,4 +189,43 @@ uint32_t fire_ticker(uint32_t ticks);
 
 void nvmc_tick();
 
+// The message bus (MicroBitMessageBus.cpp) drops events once its queue, or a busy listener's
+// queue, holds this many (MESSAGE_BUS_LISTENER_MAX_QUEUE_DEPTH by default).
+void set_event_queue_depth(uint32_t depth);
+
+struct event_queue_stats_t {
+  // Events dropped because the message bus queue was full.
+  uint32_t dropped;
+  // Events dropped because a busy listener's queue was full.
+  uint32_t listener_dropped;
+  // Events dropped because a listener was busy and set to drop events while busy.
+  uint32_t busy_dropped;
+  // The most events ever waiting in the message bus queue.
+  uint32_t high_water;
+};
+event_queue_stats_t get_event_queue_stats();
+
+// Usage of the emulated device heap (MicroBitHeapAllocator.cpp).
+struct heap_stats_t {
+  // Total size of the heap areas.
+  uint32_t size;
+  // Bytes requested by live allocations.
+  uint32_t live_bytes;
+  // Heap used by live allocations, including block rounding and headers (and the current peak).
+  uint32_t used_bytes;
+  uint32_t peak_used_bytes;
+  // The largest allocation that could currently succeed.
+  uint32_t largest_free_bytes;
+  // The native heap the DAL falls back to when the heap areas are full: its size, and how much
+  // of it is used (and the peak).
+  uint32_t native_size;
+  uint32_t native_used_bytes;
+  uint32_t peak_native_used_bytes;
+  uint32_t allocations;
+  // Allocations that failed because the native heap was full too (the DAL panics with MICROBIT_OOM
+  // if MICROBIT_PANIC_HEAP_FULL is enabled).
+  uint32_t failures;
+};
+heap_stats_t get_heap_stats();
+
 #endif
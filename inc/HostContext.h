@@ -0,0 +1,20 @@
+#ifndef __HOST_CONTEXT_H
+#define __HOST_CONTEXT_H
+
+#include <stddef.h>
+
+// Runs a function in its own context (with its own stack) on the calling thread, switching into
+// it and back explicitly. Used to run the VM on the event loop thread (see -S in README.md).
+
+// Create the context. It doesn't start running until the first host_context_resume().
+bool host_context_create(void (*entry)(), size_t stack_size);
+void host_context_destroy();
+
+// Switch to the context until it calls host_context_yield() or entry returns.
+void host_context_resume();
+// Called from within the context to switch back to the caller of host_context_resume().
+void host_context_yield();
+// Whether entry has returned.
+bool host_context_finished();
+
+#endif
@@ -70,6 +70,9 @@ struct Fiber
 
 extern Fiber *currentFiber;
 
+// The fiber that runs the VM. It's never descheduled (see source/MicroBitFiber.cpp).
+extern Fiber mainFiber;
+
 /**
   * Initialises the Fiber scheduler. 
   * Creates a Fiber context around the calling thread, and adds it to the run queue as the current thread.
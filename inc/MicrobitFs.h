@@ -0,0 +1,36 @@
+#ifndef __MICROBIT_FS_H
+#define __MICROBIT_FS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Host-side access to the MicroPython filesystem in flash_rom (see -P and -E in README.md), so
+// files can be loaded before the script runs and collected afterwards without going through the
+// REPL.
+//
+// This mirrors the on-flash layout used by filesystem.c in microbit-micropython: the region
+// between the end of the code and the appended script holds up to 252 chunks of 128 bytes, plus
+// one spare "persistent" page (marked PERSISTENT_DATA_MARKER) at either end that is used when
+// the filesystem is compacted. Each chunk is [marker][126 bytes of data][next chunk]. The first
+// chunk of a file has marker FILE_START, and its data starts with [end offset][name length][name]
+// followed by the start of the file's contents. Later chunks are marked with the index of the
+// previous chunk.
+
+const size_t MICROBIT_FS_CHUNK_SIZE = 128;
+const size_t MICROBIT_FS_DATA_PER_CHUNK = MICROBIT_FS_CHUNK_SIZE - 2;
+const size_t MICROBIT_FS_MAX_CHUNKS = 252;
+const size_t MICROBIT_FS_MAX_FILENAME_LENGTH = 120;
+
+const uint8_t MICROBIT_FS_FREED_CHUNK = 0;
+const uint8_t MICROBIT_FS_PERSISTENT_DATA_MARKER = 253;
+const uint8_t MICROBIT_FS_FILE_START = 254;
+const uint8_t MICROBIT_FS_UNUSED_CHUNK = 255;
+
+// Add the files from a directory or a tar archive to the filesystem (formatting it first if
+// necessary). Existing files with the same names are replaced.
+bool microbit_fs_import(const char* path);
+
+// Write every file in the filesystem to dir (created if necessary).
+bool microbit_fs_export(const char* dir);
+
+#endif
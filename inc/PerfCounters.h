@@ -0,0 +1,80 @@
+#ifndef __PERF_COUNTERS_H
+#define __PERF_COUNTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+
+// Internal performance counters, reported in the microbit_stats record (see -c in README.md).
+// When they're disabled, counting costs a single predictable branch.
+
+enum PerfCounter {
+  // Calls to the VM branch hook, and __WFI() entries.
+  PERF_HOOK_CALLS,
+  PERF_WFI_ENTRIES,
+  // Timer (ticker) events, and times the code thread was woken from the hook or __WFI().
+  PERF_TIMER_FIRES,
+  PERF_CODE_WAKEUPS,
+  PERF_SIGNAL_INTERRUPT_CALLS,
+  // code_lock acquisitions, and the total time spent waiting for and holding it.
+  PERF_CODE_LOCK_ACQUISITIONS,
+  PERF_CODE_LOCK_WAIT_NS,
+  PERF_CODE_LOCK_HOLD_NS,
+  PERF_COUNTER_COUNT,
+};
+
+// Counters kept per record or event type.
+enum PerfCounterGroup {
+  PERF_GROUP_UPDATES,
+  PERF_GROUP_CLIENT_EVENTS,
+  PERF_GROUP_COUNT,
+};
+
+extern bool perf_counters_enabled;
+extern uint64_t perf_counters[PERF_COUNTER_COUNT];
+
+inline void
+perf_count(PerfCounter counter, uint64_t n = 1) {
+  if (perf_counters_enabled) {
+    __atomic_add_fetch(&perf_counters[counter], n, __ATOMIC_RELAXED);
+  }
+}
+
+inline uint64_t
+perf_now_ns() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Start counting (from zero, with the wall clock starting now).
+void perf_counters_start();
+
+// Count one record/event of the given type (len bytes of name), of the given size.
+void perf_count_type(PerfCounterGroup group, const char* name, size_t len, size_t bytes);
+
+// The counters as a JSON object, including the ratio of virtual time (virtual_ms) to wall time.
+std::string perf_counters_json(uint64_t virtual_ms);
+
+// A histogram of latencies in microseconds, with eight log-linear buckets per power of two (so
+// percentiles are within 12.5%). Samples are clamped to 2^32us.
+const int LATENCY_HISTOGRAM_BUCKETS = 8 + 29 * 8;
+
+struct latency_histogram_t {
+  uint64_t count;
+  uint64_t max_us;
+  uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+void latency_histogram_add(latency_histogram_t* h, uint64_t us);
+
+// The latency that p percent (0-100) of samples are at or below (rounded down to the start of the
+// bucket, except that the maximum is exact).
+uint64_t latency_histogram_percentile(const latency_histogram_t* h, uint32_t p);
+
+// { "count": N, "p50_us": N, "p99_us": N, "max_us": N }
+std::string latency_histogram_json(const latency_histogram_t* h);
+
+#endif
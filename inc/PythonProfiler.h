@@ -0,0 +1,57 @@
+#ifndef __PYTHON_PROFILER_H
+#define __PYTHON_PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sampling profiler for Python code (see -y in README.md). The ticker marks a sample as due every
+// few macro ticks, and the VM branch hook takes it by asking the firmware for the current Python
+// call stack. Samples are aggregated into folded stacks and sent in a microbit_profile record when
+// the simulator shuts down.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One Python frame, as reported by the firmware.
+typedef struct {
+  // Source file and function names. They must stay valid until the run ends (e.g. qstrs).
+  const char* file;
+  const char* function;
+  uint32_t line;
+} simulated_dal_frame_t;
+
+// Implemented by the firmware (it's weak so that firmware without profiler support still links).
+// Fills frames with the current Python call stack, innermost frame first, and returns the number
+// of frames filled (at most max). Only called while the VM is stopped in the branch hook or
+// __WFI().
+size_t simulated_dal_micropy_profile_stack(simulated_dal_frame_t* frames, size_t max)
+    __attribute__((weak));
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+extern bool profiler_enabled;
+// Set by the ticker when a sample is due, and cleared by the VM hook once it has taken it.
+// Protected by code_lock.
+extern bool profiler_sample_due;
+
+// Start sampling every interval macro ticks. Returns false if the firmware doesn't support it.
+bool profiler_start(uint32_t interval);
+
+// Called by the ticker (holding code_lock) every macro tick. If a sample is due and the VM is
+// waiting in __WFI(), it's taken straight away (and counted as idle). Otherwise the next call to
+// the VM hook takes it.
+void profiler_tick(uint32_t macro_ticks, bool vm_waiting);
+
+// Record the current Python call stack. Caller must hold code_lock.
+void profiler_sample(bool idle);
+
+// The profile as a JSON object, with the folded stacks (outermost frame first, separated by ';')
+// and how many samples had each one.
+std::string profiler_json();
+#endif
+
+#endif
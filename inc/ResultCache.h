@@ -0,0 +1,41 @@
+#ifndef __RESULT_CACHE_H
+#define __RESULT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Sha256.h"
+
+// On-disk cache of the complete output of deterministic runs (see -C in README.md). Entries are
+// keyed by a hash of everything that determines the output: the script, the firmware build, the
+// options and the input trace.
+
+// Output is stored as a sequence of chunks ([uint8_t stream][uint32_t len][data]), so that
+// updates and serial output are replayed in the order they were produced.
+enum ResultCacheStream {
+  RESULT_CACHE_UPDATES = 0,
+  RESULT_CACHE_STDOUT = 1,
+  // Final chunk of every complete entry: the simulator's exit status (int32_t).
+  RESULT_CACHE_STATUS = 2,
+};
+
+// Add the build ID of the running executable (or failing that, its contents) to a key.
+void result_cache_hash_build_id(sha256_t* ctx);
+
+// Set the cache directory (created if necessary) and the maximum total size of all entries.
+bool result_cache_init(const char* dir, uint64_t max_bytes);
+
+// On a hit, write the cached output to updates_fd and stdout, set status and return true.
+bool result_cache_replay(const char* key, int updates_fd, int* status);
+
+// Start capturing output to store under key. Everything forked after this shares the capture.
+bool result_cache_begin(const char* key);
+bool result_cache_capturing();
+// Add output to the capture. Safe to call from any thread.
+void result_cache_capture(ResultCacheStream stream, const void* buf, size_t len);
+// Write out anything buffered (call before the process exits).
+void result_cache_flush();
+// Finish the capture, storing it as a complete entry if store is set.
+void result_cache_end(bool store, int status);
+
+#endif
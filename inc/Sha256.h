@@ -0,0 +1,25 @@
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal SHA-256, used to build content-addressed cache keys.
+
+const size_t SHA256_DIGEST_SIZE = 32;
+// Hex digest, including the terminating null.
+const size_t SHA256_HEX_SIZE = SHA256_DIGEST_SIZE * 2 + 1;
+
+struct sha256_t {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  size_t block_len;
+};
+
+void sha256_init(sha256_t* ctx);
+void sha256_update(sha256_t* ctx, const void* data, size_t len);
+void sha256_final(sha256_t* ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256_final_hex(sha256_t* ctx, char hex[SHA256_HEX_SIZE]);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __SIMULATOR_STATE_H
+#define __SIMULATOR_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Layout of the shared-memory device state page (see GROK_STATE_SHM in README.md).
+// The simulator publishes the latest device state here once per macro tick, so an observer can
+// mmap the page and poll it at any rate without syscalls or parsing JSON. Ordered events (radio
+// tx, acks, etc) are only available from the updates stream.
+//
+// Every field is a uint32_t so the layout is the same for 32 and 64-bit observers.
+
+#define SIMULATOR_STATE_MAGIC 0x5453424d  // "MBST"
+#define SIMULATOR_STATE_VERSION 1
+
+#define SIMULATOR_STATE_LEDS 25
+#define SIMULATOR_STATE_PINS 23
+
+typedef struct {
+  uint32_t macro_ticks;
+  // LED brightness on the 0-9 scale used by microbit_leds.
+  uint32_t leds[SIMULATOR_STATE_LEDS];
+  // Pin states (GpioPinState in Hardware.h) and PWM settings, as sent in microbit_pins.
+  uint32_t pins[SIMULATOR_STATE_PINS];
+  uint32_t pwm_dutycycle[SIMULATOR_STATE_PINS];
+  uint32_t pwm_period[SIMULATOR_STATE_PINS];
+  // Radio config, as sent in microbit_radio_config.
+  uint32_t radio_enabled;
+  uint32_t radio_channel;
+  uint32_t radio_base;
+  uint32_t radio_prefix;
+  uint32_t radio_data_rate;
+} simulator_state_data_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  // Seqlock: odd while the simulator is writing, incremented again once data is consistent.
+  uint32_t seq;
+  uint32_t reserved;
+  simulator_state_data_t data;
+} simulator_state_t;
+
+// Copy a consistent snapshot of the state out of the shared page.
+static inline void
+simulator_state_read(const simulator_state_t* state, simulator_state_data_t* out) {
+  uint32_t seq;
+  do {
+    while ((seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    memcpy(out, (const void*)&state->data, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) != seq);
+}
+
+#endif
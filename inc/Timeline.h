@@ -0,0 +1,56 @@
+#ifndef __TIMELINE_H
+#define __TIMELINE_H
+
+#include <stdint.h>
+
+#include "PerfCounters.h"
+
+// Timeline of what the simulator's threads spend their time on (see -T in README.md), written as
+// Chrome trace events for chrome://tracing or Perfetto. Spans are kept in per-thread buffers, so
+// recording one takes no locks, and each run writes its buffers when it finishes. When the
+// timeline is disabled, each span costs a single branch.
+
+extern bool timeline_enabled;
+
+// Create (or truncate) the timeline file, shared by all runs of the simulator. Returns false on
+// failure.
+bool timeline_open(const char* path);
+
+// Name the calling thread's track.
+void timeline_thread_name(const char* name);
+
+// Record a span on the calling thread's track. name must be a string literal (or otherwise
+// outlive the run).
+void timeline_span(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+// Append every thread's spans to the timeline file, as the given run.
+// The other threads must have stopped recording.
+void timeline_write(uint32_t run);
+
+// For spans that can't be scoped: the start time (zero if the timeline is disabled), then the span.
+inline uint64_t
+timeline_begin() {
+  return timeline_enabled ? perf_now_ns() : 0;
+}
+
+inline void
+timeline_end(const char* name, uint64_t start_ns) {
+  if (start_ns) {
+    timeline_span(name, start_ns, perf_now_ns());
+  }
+}
+
+// Records a span from construction until the end of the scope.
+struct timeline_scope_t {
+  const char* name;
+  uint64_t start_ns;
+
+  explicit timeline_scope_t(const char* name) : name(name), start_ns(timeline_begin()) {
+  }
+
+  ~timeline_scope_t() {
+    timeline_end(name, start_ns);
+  }
+};
+
+#endif
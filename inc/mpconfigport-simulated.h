@@ -1,3 +1,19 @@
 extern void simulated_dal_micropy_vm_hook_loop();
 
 #define MICROPY_VM_HOOK_LOOP simulated_dal_micropy_vm_hook_loop();
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytecode cache for the initial script (see -b in the simulator's README.md). mprun.c loads the
+// returned bytecode instead of compiling the source, and otherwise stores what it compiled.
+// Firmware that does this defines simulated_dal_micropy_compiled_script_support (the simulator
+// refuses -b without it).
+extern void simulated_dal_micropy_compiled_script_support(void) __attribute__((weak));
+extern const void* simulated_dal_get_compiled_script(size_t* len);
+extern void simulated_dal_store_compiled_script(const void* bytecode, size_t len,
+                                                uint32_t compile_us);
+
+// Python sampling profiler (see -y in the simulator's README.md). The firmware implements
+// simulated_dal_micropy_profile_stack to report the current call stack.
+#include "PythonProfiler.h"
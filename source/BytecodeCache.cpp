@@ -0,0 +1,141 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// See BytecodeCache.h.
+
+#include "BytecodeCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ResultCache.h"
+#include "Sha256.h"
+
+namespace {
+const char BYTECODE_CACHE_MAGIC[4] = {'M', 'B', 'B', 'C'};
+const uint32_t BYTECODE_CACHE_VERSION = 1;
+
+struct bytecode_cache_header_t {
+  char magic[4];
+  uint32_t version;
+  uint32_t compile_us;
+  uint32_t len;
+};
+
+std::string cache_path;
+}
+
+bool
+bytecode_cache_init(const char* dir, const char* script) {
+  if (mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+    perror("bytecode cache mkdir");
+    return false;
+  }
+
+  sha256_t ctx;
+  sha256_init(&ctx);
+  const char version[] = "microbit-bytecode-cache-1";
+  sha256_update(&ctx, version, sizeof(version));
+  result_cache_hash_build_id(&ctx);
+  sha256_update(&ctx, script, strlen(script) + 1);
+
+  char key[SHA256_HEX_SIZE];
+  sha256_final_hex(&ctx, key);
+  cache_path = std::string(dir) + "/" + key + ".mpy";
+  return true;
+}
+
+bool
+bytecode_cache_enabled() {
+  return !cache_path.empty();
+}
+
+bool
+bytecode_cache_load(std::string* bytecode, uint32_t* compile_us) {
+  if (cache_path.empty()) {
+    return false;
+  }
+  int fd = open(cache_path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  std::string entry;
+  char buf[65536];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    entry.append(buf, len);
+  }
+  close(fd);
+
+  bytecode_cache_header_t header;
+  if (entry.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, entry.data(), sizeof(header));
+  if (memcmp(header.magic, BYTECODE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != BYTECODE_CACHE_VERSION || entry.size() != sizeof(header) + header.len) {
+    return false;
+  }
+
+  bytecode->assign(entry, sizeof(header), header.len);
+  *compile_us = header.compile_us;
+  return true;
+}
+
+void
+bytecode_cache_store(const void* bytecode, size_t len, uint32_t compile_us) {
+  if (cache_path.empty()) {
+    return;
+  }
+
+  bytecode_cache_header_t header;
+  memcpy(header.magic, BYTECODE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_CACHE_VERSION;
+  header.compile_us = compile_us;
+  header.len = len;
+
+  std::string entry(reinterpret_cast<const char*>(&header), sizeof(header));
+  entry.append(static_cast<const char*>(bytecode), len);
+
+  // Write to a temporary file and rename it into place, so readers never see a partial entry.
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp.%d", getpid());
+  std::string tmp_path = cache_path + suffix;
+  int fd =
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    perror("bytecode cache store");
+    return;
+  }
+  bool ok = write(fd, entry.data(), entry.size()) == static_cast<ssize_t>(entry.size());
+  close(fd);
+  if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+    unlink(tmp_path.c_str());
+  }
+}
@@ -24,6 +24,7 @@ SOFTWARE.
 
 #include <math.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <termios.h>
 #include <unistd.h>
 #include <limits>
@@ -59,9 +60,20 @@ volatile uint serial_buffer_echo = 0;
 
 bool serial_irq_rx_enabled = false;
 uart_irq_handler serial_irq = 0;
+
+serial_output_observer_t serial_output_observer = nullptr;
 }
 
 namespace {
+// Like strncpy, but only writes as much of dst as it needs to (strncpy pads it with zeros). The
+// large string buffers below then only take up memory as far as they've been used.
+void
+copy_string(char* dst, const char* src, size_t size) {
+  size_t len = strnlen(src, size - 1);
+  memcpy(dst, src, len);
+  dst[len] = 0;
+}
+
 volatile bool _reset_flag = false;
 volatile bool _panic_flag = false;
 volatile bool _disconnect_flag = false;
@@ -82,6 +94,11 @@ serial_add_byte(uint8_t c) {
   }
 }
 
+void
+set_serial_output_observer(serial_output_observer_t observer) {
+  serial_output_observer = observer;
+}
+
 // serial_api.h
 void
 serial_init(serial_t* obj, PinName tx, PinName rx) {
@@ -146,6 +163,9 @@ serial_putc(serial_t* obj, int c) {
   if (c == '\r') {
     c = '\n';
   }
+  if (serial_output_observer) {
+    serial_output_observer(c);
+  }
   putc(c, stdout);
   fflush(stdout);
 }
@@ -477,33 +497,59 @@ nrf_gpio_pins_clear(uint32_t pin_mask) {
 }
 }
 
+namespace {
+// Pages of flash written since the last sync (bit n is page n). Only tracked when flash is backed
+// by a file, otherwise there's nothing to write back.
+static_assert(FLASH_ROM_SIZE / FLASH_PAGE_SIZE <= 64, "flash dirty bitmap too small");
+bool flash_file_backed = false;
+uint64_t flash_dirty_pages = 0;
+
+void
+mark_flash_dirty(uint32_t addr, size_t len) {
+  if (!flash_file_backed || len == 0) {
+    return;
+  }
+  size_t start = flash_pointer(addr) - flash_rom;
+  if (start >= FLASH_ROM_SIZE) {
+    return;
+  }
+  size_t end = min(start + len, FLASH_ROM_SIZE);
+  for (size_t page = start / FLASH_PAGE_SIZE; page <= (end - 1) / FLASH_PAGE_SIZE; ++page) {
+    flash_dirty_pages |= 1ULL << page;
+  }
+}
+}
+
 extern "C" {
-NRF_FICR_t _NRF_FICR = {4096};
+NRF_FICR_t _NRF_FICR = {FLASH_PAGE_SIZE};
 NRF_RNG_t _NRF_RNG;
 NRF_NVMC_t _NRF_NVMC = {0};
 
 void
 nrf_nvmc_write_byte(uint32_t addr, uint8_t b) {
-  *reinterpret_cast<uint8_t*>(addr) = b;
+  *flash_pointer(addr) = b;
+  mark_flash_dirty(addr, 1);
 }
 void
 nrf_nvmc_write_words(uint32_t addr, const uint32_t* d, size_t len) {
-  uint32_t* mem = reinterpret_cast<uint32_t*>(addr);
+  uint32_t* mem = reinterpret_cast<uint32_t*>(flash_pointer(addr));
   for (size_t i = 0; i < len; ++i) {
     *mem++ = *d++;
   }
+  mark_flash_dirty(addr, len * sizeof(uint32_t));
 }
 void
 nrf_nvmc_write_bytes(uint32_t addr, const uint8_t* d, size_t len) {
-  uint8_t* mem = reinterpret_cast<uint8_t*>(addr);
+  uint8_t* mem = flash_pointer(addr);
   for (size_t i = 0; i < len; ++i) {
     *mem++ = *d++;
   }
+  mark_flash_dirty(addr, len);
 }
 void
 nrf_nvmc_page_erase(uint32_t addr) {
-  void* mem = reinterpret_cast<void*>(addr);
-  memset(mem, 0xff, 4096);
+  memset(flash_pointer(addr), 0xff, FLASH_PAGE_SIZE);
+  mark_flash_dirty(addr, FLASH_PAGE_SIZE);
 }
 }
 
@@ -697,7 +743,7 @@ GpioPin::get_voltage() {
     if (isnan(_analog)) {
       switch (_pull) {
         case PullNone:
-          return 1.57 + drand48() - 0.5;
+          return 1.57 + get_entropy() / 4294967296.0 - 0.5;
         case PullUp:
           return 3.3;
         case PullDown:
@@ -837,6 +883,25 @@ get_temperature(int32_t* t) {
   *t = _temperature;
 }
 
+namespace {
+uint64_t _entropy_state = 0;
+}
+
+void
+set_entropy_seed(uint64_t seed) {
+  _entropy_state = seed;
+}
+
+// splitmix64.
+uint32_t
+get_entropy() {
+  uint64_t z = (_entropy_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z = z ^ (z >> 31);
+  return static_cast<uint32_t>(z >> 32);
+}
+
 namespace {
 volatile bool _inject_random = false;
 volatile int32_t _next_random = 0;
@@ -860,9 +925,18 @@ set_random_state(int32_t next, int32_t repeat) {
   }
 }
 
+// Returns whether injected random values are in use, and if so the injected value and how many
+// more calls it's good for (negative once the limit is exceeded).
+bool
+get_random_state(int32_t* next, int32_t* remaining) {
+  *next = _next_random;
+  *remaining = _remaining_random;
+  return _inject_random;
+}
+
 void
 set_random_seed(uint32_t seed) {
-  srand(seed);
+  set_entropy_seed(seed);
 }
 
 uint32_t
@@ -871,7 +945,8 @@ get_random() {
     --_remaining_random;
     return _next_random;
   } else {
-    return rand();
+    // Same range as rand().
+    return get_entropy() >> 1;
   }
 }
 
@@ -883,7 +958,7 @@ has_exceeded_random_call_limit() {
 void
 set_random_choice(int32_t count, const char* result) {
   _random_choice_count = count;
-  strncpy(_random_choice_repr, result, sizeof(_random_choice_repr));
+  copy_string(_random_choice_repr, result, sizeof(_random_choice_repr));
 }
 
 bool
@@ -934,8 +1009,8 @@ simulator_radio_get_config(bool* enabled, uint8_t* channel, uint32_t* base0, uin
 void
 simulator_radio_send(const uint8_t* buf, uint32_t len) {
   simulator_radio_frame_t f;
-  memcpy(f.data, buf, len);
-  f.len = len;
+  f.len = min(len, static_cast<uint32_t>(sizeof(f.data)));
+  memcpy(f.data, buf, f.len);
   f.channel = _radio_channel;
   f.base0 = _radio_base0;
   f.prefix0 = _radio_prefix0;
@@ -982,8 +1057,8 @@ char _marker_failure_message[20480] = {0};
 void
 set_marker_failure_event(const char* category, const char* message) {
   if (category && message) {
-    strncpy(_marker_failure_category, category, sizeof(_marker_failure_category));
-    strncpy(_marker_failure_message, message, sizeof(_marker_failure_message));
+    copy_string(_marker_failure_category, category, sizeof(_marker_failure_category));
+    copy_string(_marker_failure_message, message, sizeof(_marker_failure_message));
   } else {
     _marker_failure_category[0] = 0;
     _marker_failure_message[0] = 0;
@@ -1043,3 +1118,42 @@ void
 disable_echo() {
   _disable_echo = true;
 }
+
+// Called by Main.cpp when flash_rom is a shared mapping of a file.
+void
+set_flash_file_backed(bool backed) {
+  flash_file_backed = backed;
+  flash_dirty_pages = 0;
+}
+
+// Write back dirty flash pages, one msync per run of contiguous pages.
+void
+sync_flash(bool wait) {
+  uint64_t dirty = flash_dirty_pages;
+  flash_dirty_pages = 0;
+  const size_t pages = FLASH_ROM_SIZE / FLASH_PAGE_SIZE;
+  size_t page = 0;
+  while (page < pages) {
+    if (!(dirty & (1ULL << page))) {
+      ++page;
+      continue;
+    }
+    size_t first = page;
+    while (page < pages && (dirty & (1ULL << page))) {
+      ++page;
+    }
+    if (msync(flash_rom + first * FLASH_PAGE_SIZE, (page - first) * FLASH_PAGE_SIZE,
+              wait ? MS_SYNC : MS_ASYNC) == -1) {
+      perror("msync flash");
+    }
+  }
+}
+
+// Called by Main.cpp on every ticker event (holding code_lock), so that writes made during a tick
+// are written back together.
+void
+nvmc_tick() {
+  if (flash_dirty_pages) {
+    sync_flash(false);
+  }
+}
@@ -0,0 +1,105 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// See HostContext.h.
+
+#include "HostContext.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace {
+ucontext_t caller_context;
+ucontext_t entry_context;
+void (*entry_fn)() = nullptr;
+bool finished = false;
+
+// The stack is mapped lazily (only the pages the VM touches are committed), with a guard page
+// below it so an overflow faults rather than corrupting memory.
+void* stack_mapping = nullptr;
+size_t stack_mapping_size = 0;
+
+void
+run_entry() {
+  entry_fn();
+  finished = true;
+  // Returning switches to uc_link (the caller of host_context_resume).
+}
+}
+
+bool
+host_context_create(void (*entry)(), size_t stack_size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  stack_size = (stack_size + page - 1) / page * page;
+  stack_mapping_size = stack_size + page;
+  stack_mapping = mmap(NULL, stack_mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (stack_mapping == MAP_FAILED) {
+    perror("mmap context stack");
+    stack_mapping = nullptr;
+    return false;
+  }
+  mprotect(stack_mapping, page, PROT_NONE);
+
+  if (getcontext(&entry_context) == -1) {
+    perror("getcontext");
+    host_context_destroy();
+    return false;
+  }
+  entry_context.uc_stack.ss_sp = static_cast<char*>(stack_mapping) + page;
+  entry_context.uc_stack.ss_size = stack_size;
+  entry_context.uc_link = &caller_context;
+  entry_fn = entry;
+  finished = false;
+  makecontext(&entry_context, &run_entry, 0);
+  return true;
+}
+
+void
+host_context_destroy() {
+  if (stack_mapping) {
+    munmap(stack_mapping, stack_mapping_size);
+    stack_mapping = nullptr;
+  }
+}
+
+void
+host_context_resume() {
+  if (finished) {
+    return;
+  }
+  swapcontext(&caller_context, &entry_context);
+}
+
+void
+host_context_yield() {
+  swapcontext(&entry_context, &caller_context);
+}
+
+bool
+host_context_finished() {
+  return finished;
+}
@@ -37,7 +37,9 @@ extern "C" void app_main();
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -45,15 +47,28 @@ extern "C" void app_main();
 #include <unistd.h>
 
 #include <algorithm>
+#include <deque>
+#include <string>
 #include <type_traits>
+#include <vector>
 
 // Interface to the hardware simulation (gpio, ticker, etc).
+#include "BytecodeCache.h"
 #include "Hardware.h"
+#include "HostContext.h"
+#include "MicrobitFs.h"
+#include "PerfCounters.h"
+#include "PythonProfiler.h"
+#include "ResultCache.h"
+#include "SimulatorState.h"
+#include "Timeline.h"
 
 // For the MICROBIT_PIN_* constants.
 #include "MicroBitPin.h"
 // For the GESTURE_* constants.
 #include "MicroBitAccelerometer.h"
+// For running DAL fibers from the VM.
+#include "MicroBitFiber.h"
 
 extern "C" {
 // Simple JSON library.
@@ -76,6 +91,43 @@ int updates_fd = -1;
 // Writes to ___device_updates can come from either thread.
 pthread_mutex_t updates_file_lock;
 
+// How an update record may be treated when the outbound queue is full. Device state snapshots are
+// superseded by the next snapshot of the same kind, so older ones can be dropped. Everything else
+// (acks, radio tx, marker failures, bye, etc) must be delivered in order.
+enum UpdateKind {
+  UPDATE_ORDERED,
+  UPDATE_LEDS,
+  UPDATE_PINS,
+};
+
+struct pending_update_t {
+  UpdateKind kind;
+  std::string data;
+};
+
+// Updates are written with a non-blocking fd so that a stalled client never stalls the simulator.
+// Anything that can't be written immediately waits in this queue (protected by updates_file_lock)
+// and is drained when the main thread's epoll says updates_fd is writable.
+const size_t UPDATES_QUEUE_MAX_RECORDS = 256;
+std::deque<pending_update_t> updates_queue;
+// Number of bytes of the record at the front of the queue that have already been written.
+size_t updates_queue_head_written = 0;
+size_t updates_queue_bytes = 0;
+// Whether updates_fd is currently in the main thread's epoll set (waiting for EPOLLOUT).
+int updates_epoll_fd = -1;
+bool updates_epoll_armed = false;
+
+// Optional shared-memory page (from GROK_STATE_SHM) where the latest device state is published.
+// The check_*() functions fill in state_shadow, which is copied to the page under the seqlock
+// once per macro tick.
+simulator_state_t* shared_state = nullptr;
+simulator_state_data_t state_shadow;
+
+// Counters for the outbound queue, reported in the microbit_stats record.
+uint32_t updates_shed = 0;
+size_t updates_queue_high_water = 0;
+size_t updates_queue_high_water_bytes = 0;
+
 // In fast mode, every time we write a client update, we go to sleep until the marker
 // resumes via a client event.
 // Writing to the updates file locks this, and progress on the code thread blocks on it.
@@ -88,6 +140,39 @@ pthread_cond_t suspend_wait;
 // any modification to state accessed by micropython must also hold this lock.
 pthread_mutex_t code_lock;
 
+// When code_lock was last acquired, while perf counters are enabled. Only used by the holder.
+uint64_t code_lock_acquired_ns = 0;
+
+// Waits for code_lock at least this long are recorded on the timeline (-T). The lock is bounced
+// on every branch, so recording every acquisition would swamp everything else.
+const uint64_t TIMELINE_MIN_LOCK_WAIT_NS = 10000;
+
+// Acquire and release code_lock, counting acquisitions and wait and hold times when perf counters
+// are enabled, and recording long waits on the timeline.
+void
+lock_code() {
+  if (!perf_counters_enabled && !timeline_enabled) {
+    pthread_mutex_lock(&code_lock);
+    return;
+  }
+  uint64_t start = perf_now_ns();
+  pthread_mutex_lock(&code_lock);
+  code_lock_acquired_ns = perf_now_ns();
+  perf_count(PERF_CODE_LOCK_ACQUISITIONS);
+  perf_count(PERF_CODE_LOCK_WAIT_NS, code_lock_acquired_ns - start);
+  if (timeline_enabled && code_lock_acquired_ns - start >= TIMELINE_MIN_LOCK_WAIT_NS) {
+    timeline_span("code_lock wait", start, code_lock_acquired_ns);
+  }
+}
+
+void
+unlock_code() {
+  if (perf_counters_enabled) {
+    perf_count(PERF_CODE_LOCK_HOLD_NS, perf_now_ns() - code_lock_acquired_ns);
+  }
+  pthread_mutex_unlock(&code_lock);
+}
+
 // Set to cleanly shutdown the simulator.
 volatile bool shutdown = false;
 
@@ -132,6 +217,39 @@ bool fast_mode = false;
 // Log every HEARTBEAT_TICKS macro ticks (to keep the marker synchronized).
 bool heartbeat_mode = false;
 
+// In deterministic mode (which implies fast mode), two runs with the same script, seed and input
+// produce identical output. All entropy comes from a PRNG seeded with deterministic_seed, nothing
+// reads the real clock, and client input is only applied by the ticker, at a macro tick.
+bool deterministic_mode = false;
+uint32_t deterministic_seed = 0;
+
+// In replay mode (-R), client input comes from a recorded trace instead of the client, and the
+// simulator runs as fast as it can (never waiting for the client to resume it).
+bool replay_mode = false;
+
+// Which run of the simulator this is (incremented by the parent process on every reset).
+uint32_t simulator_run = 0;
+
+// Directory the filesystem is exported to when the simulator shuts down (-E), if any.
+const char* fs_export_dir = nullptr;
+
+// With perf counters enabled (-c), microbit_stats is also sent every this many macro ticks (if
+// non-zero).
+uint32_t perf_stats_interval = 0;
+uint32_t last_perf_stats = 0;
+
+// With the Python profiler enabled (-y), take a sample every this many macro ticks.
+uint32_t profile_interval = 0;
+// Set while the code thread is waiting in __WFI() (so samples taken then are idle). Protected by
+// code_lock.
+bool vm_in_wfi = false;
+// Set while the VM (rather than the main thread, or the code thread running the ticker) holds
+// code_lock, so that panics it can't return from can stop it. Protected by code_lock.
+bool vm_holds_code_lock = false;
+
+// How many events the message bus (and each busy listener) will queue before dropping them (-Q).
+uint32_t event_queue_depth = MESSAGE_BUS_LISTENER_MAX_QUEUE_DEPTH;
+
 // In fast mode, in either WFI or the branch hook, this is how many ticks the microbit ticker
 // expected.
 uint32_t fast_mode_ticks_until_fire_timer = 75;
@@ -139,7 +257,117 @@ uint32_t fast_mode_ticks_until_fire_timer = 75;
 // When did we last write a heartbeat, in macro ticks (if enabled in heartbeat_mode).
 uint32_t last_heartbeat = 0;
 
+// Whether device state changes (LEDs, pins, radio config, random state and heartbeats) are pushed
+// to the client as they happen. Pull-only clients turn this off (with -p or a "session" event) and
+// use "query" events instead. Ordered events like radio tx and marker failures are always sent.
+volatile bool push_updates = true;
+
+// Lockstep mode is a variant of fast mode where the client drives time explicitly with "advance"
+// events. The code thread only fires the ticker while an advance window is open. Every update
+// produced during the window is written as a single line when the window closes, and then the
+// code thread blocks until the next advance. No heartbeats or suspends are needed.
+bool lockstep_mode = false;
+pthread_mutex_t lockstep_lock;
+pthread_cond_t lockstep_wait;
+
+// Whether an advance window is open, and the macro tick at which it closes.
+volatile bool lockstep_window_open = false;
+uint32_t lockstep_end_ticks = 0;
+
+// For "advance until next output", close the window early at the end of the first macro tick
+// that produced a device update.
+bool lockstep_until_output = false;
+volatile bool lockstep_output_seen = false;
+
+// Updates written during the current window (protected by updates_file_lock). Always starts with
+// the opening '[' of the list.
+struct buffer* lockstep_batch = nullptr;
+
+// In single-threaded mode (-S), the VM runs in its own context on the main thread rather than on a
+// code thread. Wherever the code thread would block (the branch hook, WFI, and the suspend and
+// lockstep waits), the VM switches back to the event loop instead, which resumes it once it can
+// make progress. The locks are still taken, but are never contended.
+bool single_threaded = false;
+const size_t VM_STACK_SIZE = 8 * 1024 * 1024;
+
+// What the VM is waiting for when it switches back to the event loop.
+enum VmWait {
+  VM_WAIT_NONE,
+  VM_WAIT_INTERRUPT,
+  VM_WAIT_SUSPEND,
+  VM_WAIT_LOCKSTEP,
+};
+VmWait vm_wait = VM_WAIT_NONE;
+// Set by signal_interrupt() while the VM waits (the equivalent of the interrupt_signal condvar).
+bool interrupt_pending = false;
+
+// In fast mode, how many ticker advances the VM makes between returns to the event loop.
+const int FAST_MODE_YIELD_TICKS = 10;
+
+struct client_event_handler_t;
+
+// A client event uploaded by a "schedule" event, to be applied by the ticker at a given macro
+// tick. Kept sorted by ticks, and protected by code_lock.
+struct scheduled_event_t {
+  uint32_t ticks;
+  // Position in the uploaded timeline (reported in microbit_schedule records).
+  int32_t index;
+  const client_event_handler_t* handler;
+  // Owned by the timeline.
+  json_value* data;
+};
+std::vector<scheduled_event_t> scheduled_events;
+
+// Input latency tracking (-L, see "Input latency" in README.md). Each line of client events that
+// changes device state gets an ID and the time it arrived. Once the code thread has run with it
+// applied, the next LED, pin, serial or radio output is attributed to it. Not available in
+// deterministic and replay modes, where input doesn't arrive in real time.
+bool input_latency_enabled = false;
+// Set by a "session" event to also send a microbit_input_latency record for every input.
+bool input_latency_records = false;
+
+enum LatencyKind {
+  // From arrival until the input was applied.
+  LATENCY_APPLY,
+  // From arrival until the first output of any kind, then broken down by the kind of output.
+  LATENCY_OUTPUT,
+  LATENCY_LEDS,
+  LATENCY_PINS,
+  LATENCY_SERIAL,
+  LATENCY_RADIO,
+  LATENCY_KIND_COUNT,
+};
+const char* const LATENCY_KIND_NAMES[LATENCY_KIND_COUNT] = {"apply",  "output", "leds",
+                                                            "pins",   "serial", "radio"};
+
+// A line of client events, stamped as it's read.
+struct client_input_t {
+  uint32_t id;
+  uint64_t arrival_ns;
+};
+
+struct pending_input_t {
+  uint32_t id;
+  uint64_t arrival_ns;
+  // Set once the code thread has run since the input was applied.
+  bool observed;
+};
+
+// Applied inputs that haven't produced any output yet (oldest first), the latency histograms and
+// any microbit_input_latency records waiting to be sent. Protected by code_lock.
+std::vector<pending_input_t> pending_inputs;
+latency_histogram_t input_latency[LATENCY_KIND_COUNT];
+std::string input_latency_updates;
+// Inputs given up on (there are never more than MAX_PENDING_INPUTS pending).
+uint32_t inputs_unattributed = 0;
+const size_t MAX_PENDING_INPUTS = 64;
+// Only used by the main thread.
+uint32_t next_input_id = 1;
+
 uint32_t handle_timerfd_event(uint32_t ticks);
+void fast_mode_advance_ticker();
+void vm_yield(VmWait wait);
+void observe_radio_tx(const simulator_radio_frame_t& f);
 }
 
 void
@@ -151,13 +379,40 @@ appendf(char** str, const char* end, const char* format, ...) {
   *str += min(end - *str, n);
 }
 
+namespace {
+// Give any DAL fibers that the ticker or message bus have made runnable a chance to run. Only the
+// main fiber drives the scheduler -- a fiber that reaches the hook keeps running until it blocks.
+void
+run_pending_fibers() {
+  if (currentFiber == &mainFiber && !scheduler_runqueue_empty()) {
+    schedule();
+  }
+}
+
+// Called when the code thread resumes (holding code_lock): the VM has now seen every input applied
+// so far.
+void
+observe_pending_inputs() {
+  if (!pending_inputs.empty() && !pending_inputs.back().observed) {
+    for (size_t i = 0; i < pending_inputs.size(); ++i) {
+      pending_inputs[i].observed = true;
+    }
+  }
+}
+}
+
 extern "C" {
 // Called on every jump in the VM.
 // We briefly bounce the code lock to allow the main thread to alter any state necessary.
 // And handle the shutdown/panic/reset flags if necessary.
 void
 simulated_dal_micropy_vm_hook_loop() {
-  pthread_mutex_unlock(&code_lock);
+  perf_count(PERF_HOOK_CALLS);
+  if (profiler_sample_due) {
+    profiler_sample(false);
+  }
+  vm_holds_code_lock = false;
+  unlock_code();
 
   // Code has executed since the a Ctrl-C was delivered (if any) so this means the VM is
   // processing instructions and if there was a Ctrl-C it would have been handled.
@@ -169,17 +424,19 @@ simulated_dal_micropy_vm_hook_loop() {
   }
 
   static int n = 0;
+  static int advances = 0;
   n++;
   if (n > 100) {
     if (fast_mode) {
       // In marking mode, fire the ticker every 100 branches.
-      fast_mode_ticks_until_fire_timer = handle_timerfd_event(fast_mode_ticks_until_fire_timer);
-
-      pthread_mutex_lock(&suspend_lock);
-      if (suspend) {
-        pthread_cond_wait(&suspend_wait, &suspend_lock);
+      fast_mode_advance_ticker();
+      if (single_threaded && ++advances >= FAST_MODE_YIELD_TICKS) {
+        // Let the event loop read client input.
+        advances = 0;
+        vm_yield(VM_WAIT_NONE);
       }
-      pthread_mutex_unlock(&suspend_lock);
+    } else if (single_threaded) {
+      vm_yield(VM_WAIT_INTERRUPT);
     } else {
       // Every 100 branches, wait for a timer tick.  Should be fairly
       // unnoticable for most programs, but will prevent tight loops
@@ -188,14 +445,20 @@ simulated_dal_micropy_vm_hook_loop() {
       // client events.  fast_mode doesn't have the timer_fd, but on
       // epoll timeout, it calls signal_interrupt which achieves the
       // same thing.
+      uint64_t wait_start = timeline_begin();
       pthread_mutex_lock(&interrupt_signal_lock);
       pthread_cond_wait(&interrupt_signal, &interrupt_signal_lock);
       pthread_mutex_unlock(&interrupt_signal_lock);
+      timeline_end("hook wait", wait_start);
+      perf_count(PERF_CODE_WAKEUPS);
     }
     n = 0;
   }
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
+  vm_holds_code_lock = true;
+  observe_pending_inputs();
+  run_pending_fibers();
 }
 }
 
@@ -206,7 +469,10 @@ simulated_dal_micropy_vm_hook_loop() {
 // We also use this to handle the shutdown (or reset or panic) flags being set.
 void
 __wait_for_interrupt() {
-  pthread_mutex_unlock(&code_lock);
+  perf_count(PERF_WFI_ENTRIES);
+  vm_in_wfi = true;
+  vm_holds_code_lock = false;
+  unlock_code();
 
   // Every time micro:bit tries to read from serial it calls __WFI first.
   // So if we're non-interactive (i.e. Run button or inline snippet) then
@@ -220,20 +486,24 @@ __wait_for_interrupt() {
   if (fast_mode) {
     // In fast mode, the most likely reason for WFI is waiting for the timer.
     // e.g. sleep() or synchronous music.
-    fast_mode_ticks_until_fire_timer = handle_timerfd_event(fast_mode_ticks_until_fire_timer);
-    pthread_mutex_lock(&suspend_lock);
-    if (suspend) {
-      pthread_cond_wait(&suspend_wait, &suspend_lock);
+    fast_mode_advance_ticker();
+    if (single_threaded) {
+      // Let the event loop read serial input.
+      vm_yield(VM_WAIT_NONE);
     }
-    pthread_mutex_unlock(&suspend_lock);
+  } else if (single_threaded) {
+    vm_yield(VM_WAIT_INTERRUPT);
   } else {
     // Wait for the interrupt signal, then let the signalling thread know that we're running.
+    uint64_t wait_start = timeline_begin();
     pthread_mutex_lock(&interrupt_signal_lock);
     interrupt_waiting = true;
     pthread_cond_wait(&interrupt_signal, &interrupt_signal_lock);
     interrupt_waiting = false;
     pthread_cond_broadcast(&interrupt_delivered);
     pthread_mutex_unlock(&interrupt_signal_lock);
+    timeline_end("wfi", wait_start);
+    perf_count(PERF_CODE_WAKEUPS);
   }
 
   if (shutdown || get_reset_flag() || get_panic_flag() || get_disconnect_flag()) {
@@ -241,7 +511,11 @@ __wait_for_interrupt() {
     longjmp(code_quit_jmp, 1);
   }
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
+  vm_in_wfi = false;
+  vm_holds_code_lock = true;
+  observe_pending_inputs();
+  run_pending_fibers();
 }
 
 void
@@ -255,10 +529,33 @@ void
 __disable_irq() {
 }
 
+// Called after a panic that the device never returns from (such as the heap running out), to stop
+// the VM there and then rather than let the caller carry on. Does nothing (leaving the panic flag
+// for the branch hook) unless called by the VM.
+void
+halt_on_panic() {
+  if (!vm_holds_code_lock) {
+    return;
+  }
+  vm_holds_code_lock = false;
+  unlock_code();
+  shutdown = true;
+  longjmp(code_quit_jmp, 1);
+}
+
 namespace {
 // Unblock the VM if it's sitting in __WFI().
 void
 signal_interrupt() {
+  timeline_scope_t span("signal_interrupt");
+  perf_count(PERF_SIGNAL_INTERRUPT_CALLS);
+
+  if (single_threaded) {
+    // The event loop resumes the VM once it has finished handling the current events.
+    interrupt_pending = true;
+    return;
+  }
+
   bool wait_for_delivery = false;
 
   // Signal the code thread which may be in WFI or the loop/branch hook.
@@ -273,8 +570,8 @@ signal_interrupt() {
 
   // Bounce the code lock to wait for any currently running code to go through the
   // loop hook or WFI.
-  pthread_mutex_lock(&code_lock);
-  pthread_mutex_unlock(&code_lock);
+  lock_code();
+  unlock_code();
 
   sched_yield();
 }
@@ -282,13 +579,16 @@ signal_interrupt() {
 // Run the MicroPython VM.
 void*
 code_thread_main(void*) {
+  timeline_thread_name(single_threaded ? "main" : "code");
   while (true) {
     // If we attempt to shutdown or reboot, we will longjump back to here.
     if (setjmp(code_quit_jmp) == 0) {
       // Jump set, run the VM.
 
       // Must be holding the lock while running the VM.
-      pthread_mutex_lock(&code_lock);
+      lock_code();
+      vm_in_wfi = false;
+      vm_holds_code_lock = true;
       app_main();
 
       // Normal termination (this should never happen - app_main doesn't return).
@@ -307,6 +607,38 @@ code_thread_main(void*) {
   return NULL;
 }
 
+// Entry point of the VM context in single-threaded mode.
+void
+vm_context_main() {
+  code_thread_main(nullptr);
+}
+
+// Called by the VM in single-threaded mode to switch back to the event loop until it can continue.
+void
+vm_yield(VmWait wait) {
+  vm_wait = wait;
+  interrupt_pending = false;
+  host_context_yield();
+  if (wait == VM_WAIT_INTERRUPT) {
+    perf_count(PERF_CODE_WAKEUPS);
+  }
+}
+
+// Whether the VM (in single-threaded mode) can continue.
+bool
+vm_ready() {
+  switch (vm_wait) {
+    case VM_WAIT_INTERRUPT:
+      return interrupt_pending || shutdown;
+    case VM_WAIT_SUSPEND:
+      return !suspend || shutdown;
+    case VM_WAIT_LOCKSTEP:
+      return lockstep_window_open || shutdown;
+    default:
+      return true;
+  }
+}
+
 // In the same style as MICROBIT_PIN_* (defined in MicroBitPin.h), add two special ones
 // for pins 17&18 and 21&22.
 const uint32_t MICROBIT_PIN_3V = INT_MAX;
@@ -338,42 +670,252 @@ list_to_json(const char* field, char** json_ptr, char* json_end, uint32_t* value
   }
 }
 
+// Add a single update record to the current lockstep window.
+// Caller must hold updates_file_lock.
+void
+append_to_lockstep_batch(const char* buf, size_t count) {
+  // Every record is formatted as '[{ ... }]\n', so strip the list brackets and the newline
+  // to join them into a single list.
+  if (count < 3 || buf[0] != '[' || buf[count - 2] != ']') {
+    fprintf(stderr, "Malformed update record.\n");
+    return;
+  }
+  if (lockstep_batch->nbytes_used > 1) {
+    buffer_append(lockstep_batch, ", ");
+  }
+  buffer_append_n(lockstep_batch, buf + 1, count - 3);
+}
+
+// Write as much of the outbound queue as updates_fd will currently accept, and wait for EPOLLOUT
+// if there's anything left.
+// Caller must hold updates_file_lock.
+void
+drain_updates_queue() {
+  while (!updates_queue.empty()) {
+    const std::string& data = updates_queue.front().data;
+    ssize_t status = write(updates_fd, data.data() + updates_queue_head_written,
+                           data.size() - updates_queue_head_written);
+    if (status == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Nobody is listening any more, so there's no point holding on to anything.
+        updates_queue.clear();
+        updates_queue_head_written = 0;
+        updates_queue_bytes = 0;
+      }
+      break;
+    }
+    updates_queue_head_written += status;
+    if (updates_queue_head_written == data.size()) {
+      updates_queue_bytes -= data.size();
+      updates_queue.pop_front();
+      updates_queue_head_written = 0;
+    }
+  }
+
+  bool want_epollout = !updates_queue.empty() && updates_epoll_fd != -1;
+  if (want_epollout != updates_epoll_armed) {
+    if (want_epollout) {
+      struct epoll_event ev_updates;
+      ev_updates.events = EPOLLOUT;
+      ev_updates.data.fd = updates_fd;
+      updates_epoll_armed = epoll_ctl(updates_epoll_fd, EPOLL_CTL_ADD, updates_fd, &ev_updates) == 0;
+    } else {
+      epoll_ctl(updates_epoll_fd, EPOLL_CTL_DEL, updates_fd, NULL);
+      updates_epoll_armed = false;
+    }
+  }
+}
+
+// Add a record to the outbound queue and write what we can.
+// If the queue is full, an older snapshot of the same kind of device state is replaced by this
+// one. Ordered records are never dropped, so they're always added (even past the limit).
+// Caller must hold updates_file_lock.
+void
+enqueue_update(const char* buf, size_t count, UpdateKind kind) {
+  result_cache_capture(RESULT_CACHE_UPDATES, buf, count);
+
+  if (kind != UPDATE_ORDERED && updates_queue.size() >= UPDATES_QUEUE_MAX_RECORDS) {
+    // The front record may be partially written, so it can't be removed.
+    std::deque<pending_update_t>::iterator it = updates_queue.begin();
+    if (it != updates_queue.end() && updates_queue_head_written > 0) {
+      ++it;
+    }
+    while (it != updates_queue.end()) {
+      if (it->kind == kind) {
+        updates_queue_bytes -= it->data.size();
+        it = updates_queue.erase(it);
+        ++updates_shed;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  pending_update_t update;
+  update.kind = kind;
+  update.data.assign(buf, count);
+  updates_queue.push_back(update);
+  updates_queue_bytes += count;
+
+  updates_queue_high_water = std::max(updates_queue_high_water, updates_queue.size());
+  updates_queue_high_water_bytes = std::max(updates_queue_high_water_bytes, updates_queue_bytes);
+
+  drain_updates_queue();
+}
+
+// Write everything that's still queued, waiting for the client if necessary. Used at shutdown.
+// Caller must hold updates_file_lock.
+void
+flush_updates_queue_blocking() {
+  fcntl(updates_fd, F_SETFL, fcntl(updates_fd, F_GETFL, 0) & ~O_NONBLOCK);
+  drain_updates_queue();
+  fcntl(updates_fd, F_SETFL, fcntl(updates_fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Write out everything in the current lockstep window as one line.
+// Caller must hold updates_file_lock.
+void
+flush_lockstep_batch() {
+  if (lockstep_batch->nbytes_used <= 1) {
+    return;
+  }
+  buffer_append(lockstep_batch, "]\n");
+  enqueue_update(lockstep_batch->data, lockstep_batch->nbytes_used, UPDATE_ORDERED);
+  buffer_clear(lockstep_batch);
+  buffer_append(lockstep_batch, "[");
+}
+
+// Count a write to the updates by the type of its (first) record.
+void
+count_update_type(const char* buf, size_t count) {
+  const char TYPE_KEY[] = "\"type\": \"";
+  const char* end = buf + count;
+  const char* type = static_cast<const char*>(memmem(buf, count, TYPE_KEY, sizeof(TYPE_KEY) - 1));
+  if (!type) {
+    perf_count_type(PERF_GROUP_UPDATES, "unknown", 7, count);
+    return;
+  }
+  type += sizeof(TYPE_KEY) - 1;
+  const char* type_end = static_cast<const char*>(memchr(type, '"', end - type));
+  perf_count_type(PERF_GROUP_UPDATES, type, type_end ? type_end - type : 0, count);
+}
+
 void
-write_to_updates(const void* buf, size_t count, bool should_suspend = false) {
+write_to_updates(const void* buf, size_t count, bool should_suspend = false,
+                 UpdateKind kind = UPDATE_ORDERED) {
+  timeline_scope_t span("write_to_updates");
+  if (perf_counters_enabled) {
+    count_update_type(static_cast<const char*>(buf), count);
+  }
+
   pthread_mutex_lock(&updates_file_lock);
-  if (should_suspend && fast_mode) {
+  if (lockstep_mode) {
+    // Held until the window closes. Only device state updates (not acks) count as output.
+    append_to_lockstep_batch(static_cast<const char*>(buf), count);
+    if (should_suspend) {
+      lockstep_output_seen = true;
+    }
+    pthread_mutex_unlock(&updates_file_lock);
+    return;
+  }
+  if (should_suspend && fast_mode && !replay_mode) {
     pthread_mutex_lock(&suspend_lock);
     suspend = true;
     pthread_mutex_unlock(&suspend_lock);
   }
-  int status = write(updates_fd, buf, count);
+  enqueue_update(static_cast<const char*>(buf), count, kind);
   pthread_mutex_unlock(&updates_file_lock);
 }
 
-// Called periodically (currently every macro tick) to send GPIO pin state back to the client.
-// We're less strict about waiting for changes to stabilize (compared to the LED matrix) because
-// we're not dealing with things like row/column scanning.
-// There are 25 pins on the micro:bit, but we exclude the final two (3.3V and GND).
-// Pin states are in the GpioPinState enum in Hardware.h.
-// TODO(jim): Break this up into mode and value.
+// Write a reply to a client request (e.g. a query) straight away. Unlike write_to_updates, this
+// isn't held until the end of a lockstep window, so the reply can arrive before that window's line.
 void
-check_gpio_updates() {
-  static uint32_t prev_pins[23] = {0};
-  static uint32_t prev_pwm_dutycycle[23] = {0};
-  static uint32_t prev_pwm_period[23] = {0};
+write_reply_to_updates(const void* buf, size_t count) {
+  timeline_scope_t span("write_to_updates");
+  if (perf_counters_enabled) {
+    count_update_type(static_cast<const char*>(buf), count);
+  }
 
-  if (suppress_pin_led_updates) {
+  pthread_mutex_lock(&updates_file_lock);
+  enqueue_update(static_cast<const char*>(buf), count, UPDATE_ORDERED);
+  pthread_mutex_unlock(&updates_file_lock);
+}
+
+// Start tracking an input that has just been applied.
+// Caller must hold code_lock.
+void
+track_input_latency(const client_input_t& input, uint64_t applied_ns) {
+  latency_histogram_add(&input_latency[LATENCY_APPLY], (applied_ns - input.arrival_ns) / 1000);
+  if (pending_inputs.size() >= MAX_PENDING_INPUTS) {
+    pending_inputs.erase(pending_inputs.begin());
+    ++inputs_unattributed;
+  }
+  pending_inputs.push_back({input.id, input.arrival_ns, false});
+}
+
+// Attribute an output of the given kind to every input the VM has seen that hasn't already
+// produced one.
+// Caller must hold code_lock.
+void
+attribute_input_latency(LatencyKind kind) {
+  if (pending_inputs.empty() || !pending_inputs.front().observed) {
     return;
   }
+  uint64_t now = perf_now_ns();
+  size_t n = 0;
+  // Inputs are observed in order, so the observed ones are at the front.
+  for (; n < pending_inputs.size() && pending_inputs[n].observed; ++n) {
+    uint64_t latency_us = (now - pending_inputs[n].arrival_ns) / 1000;
+    latency_histogram_add(&input_latency[LATENCY_OUTPUT], latency_us);
+    latency_histogram_add(&input_latency[kind], latency_us);
+    if (input_latency_records) {
+      char json[256];
+      char* json_ptr = json;
+      appendf(&json_ptr, json + sizeof(json),
+              "[{ \"type\": \"microbit_input_latency\", \"ticks\": %d, \"data\": { \"id\": %u, "
+              "\"output\": \"%s\", \"latency_us\": %llu }}]\n",
+              get_macro_ticks(), pending_inputs[n].id, LATENCY_KIND_NAMES[kind],
+              (unsigned long long)latency_us);
+      input_latency_updates.append(json, json_ptr - json);
+    }
+  }
+  pending_inputs.erase(pending_inputs.begin(), pending_inputs.begin() + n);
+}
 
-  pthread_mutex_lock(&code_lock);
+// As above, for outputs noticed by the main thread.
+void
+attribute_input_latency_unlocked(LatencyKind kind) {
+  if (input_latency_enabled) {
+    lock_code();
+    attribute_input_latency(kind);
+    unlock_code();
+  }
+}
 
-  uint32_t pins[23] = {0};
-  uint32_t pwm_dutycycle[23] = {0};
-  uint32_t pwm_period[23] = {0};
+// Send the microbit_input_latency records collected since the last call.
+void
+write_input_latency_updates() {
+  std::string updates;
+  lock_code();
+  updates.swap(input_latency_updates);
+  unlock_code();
+  if (!updates.empty()) {
+    write_to_updates(updates.data(), updates.size(), false);
+  }
+}
 
-  for (int i = 0; i < sizeof(pins) / sizeof(uint32_t); ++i) {
+// Read the state of the 23 edge connector pins (in microbit_pins order), and the PWM settings of
+// any that are PWM outputs.
+// Caller must hold code_lock.
+void
+read_gpio_state(uint32_t* pins, uint32_t* pwm_dutycycle, uint32_t* pwm_period) {
+  for (int i = 0; i < 23; ++i) {
     int pin = MICROBIT_PIN_MAP[i];
+    pwm_dutycycle[i] = 0;
+    pwm_period[i] = 0;
     if (pin == MICROBIT_PIN_3V) {
       // pins 17 & 18 -- fixed to 3.3V
       pins[i] = 1;
@@ -389,8 +931,40 @@ check_gpio_updates() {
       }
     }
   }
+}
 
-  pthread_mutex_unlock(&code_lock);
+// Called periodically (currently every macro tick) to send GPIO pin state back to the client.
+// We're less strict about waiting for changes to stabilize (compared to the LED matrix) because
+// we're not dealing with things like row/column scanning.
+// There are 25 pins on the micro:bit, but we exclude the final two (3.3V and GND).
+// Pin states are in the GpioPinState enum in Hardware.h.
+// TODO(jim): Break this up into mode and value.
+void
+check_gpio_updates() {
+  timeline_scope_t span("check_gpio_updates");
+  static uint32_t prev_pins[23] = {0};
+  static uint32_t prev_pwm_dutycycle[23] = {0};
+  static uint32_t prev_pwm_period[23] = {0};
+
+  if (suppress_pin_led_updates) {
+    return;
+  }
+
+  uint32_t pins[23] = {0};
+  uint32_t pwm_dutycycle[23] = {0};
+  uint32_t pwm_period[23] = {0};
+
+  lock_code();
+  read_gpio_state(pins, pwm_dutycycle, pwm_period);
+  unlock_code();
+
+  memcpy(state_shadow.pins, pins, sizeof(pins));
+  memcpy(state_shadow.pwm_dutycycle, pwm_dutycycle, sizeof(pwm_dutycycle));
+  memcpy(state_shadow.pwm_period, pwm_period, sizeof(pwm_period));
+
+  if (!push_updates) {
+    return;
+  }
 
   if (memcmp(pins, prev_pins, sizeof(prev_pins)) != 0 ||
       memcmp(pwm_dutycycle, prev_pwm_dutycycle, sizeof(prev_pwm_dutycycle)) != 0 ||
@@ -412,7 +986,8 @@ check_gpio_updates() {
 
     appendf(&json_ptr, json_end, "}}]\n");
 
-    write_to_updates(json, json_ptr - json, true);
+    write_to_updates(json, json_ptr - json, true, UPDATE_PINS);
+    attribute_input_latency_unlocked(LATENCY_PINS);
 
     memcpy(prev_pins, pins, sizeof(prev_pins));
     memcpy(prev_pwm_dutycycle, pwm_dutycycle, sizeof(prev_pwm_dutycycle));
@@ -433,6 +1008,15 @@ ticks_to_brightness(int ticks) {
   return 0;
 }
 
+// Get the LED brightness, and convert to our 0-9 scale.
+// Caller must hold code_lock.
+void
+read_led_state(uint32_t* leds) {
+  for (int i = 0; i < 25; ++i) {
+    leds[i] = ticks_to_brightness(get_display_led(i).brightness());
+  }
+}
+
 // Called periodically (currently every macro tick) to send LED matrix changes back
 // to the client.
 // The DisplayLed class returns brightness() as a number of ticks that it was turned on for the last
@@ -440,6 +1024,7 @@ ticks_to_brightness(int ticks) {
 // takes 3 macro ticks (1125 ticks).
 void
 check_led_updates() {
+  timeline_scope_t span("check_led_updates");
   uint32_t leds[25] = {0};
   static uint32_t leds_prev[25] = {INT_MAX};
 
@@ -447,12 +1032,15 @@ check_led_updates() {
     return;
   }
 
-  // Get the LED brightness, and convert to our 0-9 scale.
-  pthread_mutex_lock(&code_lock);
-  for (int i = 0; i < 25; ++i) {
-    leds[i] = ticks_to_brightness(get_display_led(i).brightness());
+  lock_code();
+  read_led_state(leds);
+  unlock_code();
+
+  memcpy(state_shadow.leds, leds, sizeof(leds));
+
+  if (!push_updates) {
+    return;
   }
-  pthread_mutex_unlock(&code_lock);
 
   // If it's changed since the last update, send update.
   if (memcmp(leds, leds_prev, sizeof(leds)) != 0) {
@@ -466,7 +1054,8 @@ check_led_updates() {
 
     appendf(&json_ptr, json_end, "}}]\n");
 
-    write_to_updates(json, json_ptr - json, true);
+    write_to_updates(json, json_ptr - json, true, UPDATE_LEDS);
+    attribute_input_latency_unlocked(LATENCY_LEDS);
 
     memcpy(leds_prev, leds, sizeof(leds));
   }
@@ -474,12 +1063,17 @@ check_led_updates() {
 
 void
 check_random_updates() {
+  timeline_scope_t span("check_random_updates");
   bool exceeded = false;
   static bool exceeded_prev = false;
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
   exceeded = has_exceeded_random_call_limit();
-  pthread_mutex_unlock(&code_lock);
+  unlock_code();
+
+  if (!push_updates) {
+    return;
+  }
 
   if (exceeded != exceeded_prev) {
     char json[1024];
@@ -498,18 +1092,15 @@ check_random_updates() {
 
 void
 check_marker_failure_updates() {
+  timeline_scope_t span("check_marker_failure_updates");
   const char* category = nullptr;
   const char* message = nullptr;
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
   bool has_failure = get_marker_failure_event(&category, &message);
-  pthread_mutex_unlock(&code_lock);
+  unlock_code();
 
   if (has_failure) {
-    char json[20480];
-    char* json_ptr = json;
-    char* json_end = json + sizeof(json);
-
     struct buffer* category_buf = buffer_create();
     json_write_escape_string(category_buf, category);
     buffer_reserve(category_buf, 1);
@@ -520,6 +1111,11 @@ check_marker_failure_updates() {
     buffer_reserve(message_buf, 1);
     message_buf->data[message_buf->nbytes_used] = 0;
 
+    // Sized to fit, as the message can be long (up to 20KB before escaping).
+    std::vector<char> json(category_buf->nbytes_used + message_buf->nbytes_used + 256);
+    char* json_ptr = json.data();
+    char* json_end = json_ptr + json.size();
+
     appendf(&json_ptr, json_end,
             "[{ \"type\": \"marker_failure\", \"ticks\": %d, \"data\": { \"category\": %s, "
             "\"message\": %s }}]\n",
@@ -528,24 +1124,30 @@ check_marker_failure_updates() {
     buffer_destroy(category_buf);
     buffer_destroy(message_buf);
 
-    write_to_updates(json, json_ptr - json, true);
+    write_to_updates(json.data(), json_ptr - json.data(), true);
 
-    pthread_mutex_lock(&code_lock);
+    lock_code();
     set_marker_failure_event(nullptr, nullptr);
-    pthread_mutex_unlock(&code_lock);
+    unlock_code();
   }
 }
 
 void
 check_radio_tx() {
+  timeline_scope_t span("check_radio_tx");
   simulator_radio_frame_t f;
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
   bool has_frame = simulator_radio_get_tx(&f);
-  pthread_mutex_unlock(&code_lock);
+  if (has_frame) {
+    observe_radio_tx(f);
+    attribute_input_latency(LATENCY_RADIO);
+  }
+  unlock_code();
 
   if (has_frame) {
-    char json[20480];
+    // Up to four characters (",255") per byte of the frame.
+    char json[256 + RADIO_MAX_FRAME_SIZE * 4];
     char* json_ptr = json;
     char* json_end = json + sizeof(json);
 
@@ -571,6 +1173,7 @@ check_radio_tx() {
 
 void
 check_radio_config() {
+  timeline_scope_t span("check_radio_config");
   static bool prev_enabled = false;
   static uint8_t prev_channel = 0xff;
   static uint32_t prev_base0 = 0;
@@ -583,13 +1186,23 @@ check_radio_config() {
   uint8_t prefix0 = 0;
   uint8_t data_rate = 0;
 
-  pthread_mutex_lock(&code_lock);
+  lock_code();
   simulator_radio_get_config(&enabled, &channel, &base0, &prefix0, &data_rate);
-  pthread_mutex_unlock(&code_lock);
+  unlock_code();
+
+  state_shadow.radio_enabled = enabled;
+  state_shadow.radio_channel = channel;
+  state_shadow.radio_base = base0;
+  state_shadow.radio_prefix = prefix0;
+  state_shadow.radio_data_rate = data_rate;
+
+  if (!push_updates) {
+    return;
+  }
 
   if (enabled != prev_enabled || channel != prev_channel || base0 != prev_base0 ||
       prefix0 != prev_prefix0 || data_rate != prev_data_rate) {
-    char json[20480];
+    char json[1024];
     char* json_ptr = json;
     char* json_end = json + sizeof(json);
 
@@ -608,12 +1221,79 @@ check_radio_config() {
   }
 }
 
+// Open the updates pipe (or file).
+int
+open_updates_fd() {
+  char* updates_pipe_str = getenv("GROK_UPDATES_PIPE");
+  if (updates_pipe_str != NULL) {
+    return atoi(updates_pipe_str);
+  } else {
+    return open("___device_updates", O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  }
+}
+
+// Map the shared-memory state page passed in by the client (if any).
+void
+open_shared_state() {
+  char* state_shm_str = getenv("GROK_STATE_SHM");
+  if (state_shm_str == NULL) {
+    return;
+  }
+
+  int state_fd = atoi(state_shm_str);
+  if (ftruncate(state_fd, sizeof(simulator_state_t)) == -1) {
+    perror("ftruncate state shm");
+    return;
+  }
+  void* p = mmap(NULL, sizeof(simulator_state_t), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap state shm");
+    return;
+  }
+
+  shared_state = static_cast<simulator_state_t*>(p);
+  // Leave seq alone (rather than zeroing the page), so readers that are already polling never see
+  // it go backwards across a reset.
+  shared_state->magic = SIMULATOR_STATE_MAGIC;
+  shared_state->version = SIMULATOR_STATE_VERSION;
+  memset(&state_shadow, 0, sizeof(state_shadow));
+}
+
+void
+close_shared_state() {
+  if (shared_state) {
+    munmap(shared_state, sizeof(simulator_state_t));
+    shared_state = nullptr;
+  }
+}
+
+// Copy the latest device state to the shared page under the seqlock.
+void
+publish_shared_state() {
+  if (!shared_state) {
+    return;
+  }
+
+  state_shadow.macro_ticks = get_macro_ticks();
+
+  uint32_t seq = __atomic_load_n(&shared_state->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&shared_state->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&shared_state->data, &state_shadow, sizeof(state_shadow));
+  __atomic_store_n(&shared_state->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 // Returns the number of macro ticks that we expect should have passed (based on the real clock).
 // This only makes sense in normal mode (i.e. not fast mode).
 uint32_t
 expected_macro_ticks(bool reset = false) {
   static uint32_t starting_clock = 0;
 
+  if (deterministic_mode) {
+    // Virtual time is the only time.
+    return get_macro_ticks();
+  }
+
   struct timespec t;
   clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
   uint32_t clock_ticks = (t.tv_sec * 1000 + (t.tv_nsec / 1000000)) / 6;
@@ -639,22 +1319,122 @@ write_heartbeat() {
   write_to_updates(json, json_ptr - json, true);
 }
 
+// Counters describing how the simulator itself performed, sent just before the bye (except in
+// deterministic mode), and periodically when perf counters are enabled (-c).
 void
-write_bye() {
-  char json[1024];
-  char* json_ptr = json;
-  char* json_end = json + sizeof(json);
+write_stats() {
+  // These depend on how quickly the client reads updates, so they would make the output of
+  // deterministic runs differ.
+  if (deterministic_mode) {
+    return;
+  }
 
-  appendf(&json_ptr, json_end,
-          "[{ \"type\": \"microbit_bye\", \"ticks\": %d, \"data\": { \"real_ticks\": \"%d\" }}]\n",
-          get_macro_ticks(), expected_macro_ticks());
+  std::string counters;
+  if (perf_counters_enabled) {
+    // Macro ticks are 6ms of virtual time.
+    counters = perf_counters_json(get_macro_ticks() * 6);
+  }
+
+  std::string latency;
+  if (input_latency_enabled) {
+    lock_code();
+    char pending[128];
+    snprintf(pending, sizeof(pending), "{ \"pending\": %zu, \"unattributed\": %u",
+             pending_inputs.size(), inputs_unattributed);
+    latency = pending;
+    for (int i = 0; i < LATENCY_KIND_COUNT; ++i) {
+      latency += ", \"";
+      latency += LATENCY_KIND_NAMES[i];
+      latency += "\": ";
+      latency += latency_histogram_json(&input_latency[i]);
+    }
+    latency += " }";
+    unlock_code();
+  }
+
+  std::vector<char> json(1024 + counters.size() + latency.size());
+  char* json_ptr = json.data();
+  char* json_end = json_ptr + json.size();
+
+  pthread_mutex_lock(&updates_file_lock);
+  uint32_t shed = updates_shed;
+  size_t high_water = updates_queue_high_water;
+  size_t high_water_bytes = updates_queue_high_water_bytes;
+  pthread_mutex_unlock(&updates_file_lock);
+
+  event_queue_stats_t events = get_event_queue_stats();
+
+  lock_code();
+  heap_stats_t heap = get_heap_stats();
+  unlock_code();
+  uint32_t heap_free = heap.size - heap.used_bytes;
+  uint32_t heap_fragmentation = heap_free ? 100 - 100ull * heap.largest_free_bytes / heap_free : 0;
+
+  appendf(&json_ptr, json_end, "[{ \"type\": \"microbit_stats\", \"ticks\": %d, \"data\": { ",
+          get_macro_ticks());
+  appendf(&json_ptr, json_end,
+          "\"updates_shed\": %u, \"updates_queue_high_water\": %zu, "
+          "\"updates_queue_high_water_bytes\": %zu",
+          shed, high_water, high_water_bytes);
+  appendf(&json_ptr, json_end,
+          ", \"events_dropped\": %u, \"listener_events_dropped\": %u, "
+          "\"busy_events_dropped\": %u, \"event_queue_high_water\": %u",
+          events.dropped, events.listener_dropped, events.busy_dropped, events.high_water);
+  appendf(&json_ptr, json_end,
+          ", \"heap_size\": %u, \"heap_live_bytes\": %u, \"heap_used_bytes\": %u, "
+          "\"heap_peak_bytes\": %u, \"heap_largest_free_bytes\": %u, \"heap_fragmentation\": %u, "
+          "\"heap_native_size\": %u, \"heap_native_used_bytes\": %u, "
+          "\"heap_native_peak_bytes\": %u, \"heap_allocations\": %u, \"heap_failures\": %u",
+          heap.size, heap.live_bytes, heap.used_bytes, heap.peak_used_bytes,
+          heap.largest_free_bytes, heap_fragmentation, heap.native_size, heap.native_used_bytes,
+          heap.peak_native_used_bytes, heap.allocations, heap.failures);
+  if (input_latency_enabled) {
+    appendf(&json_ptr, json_end, ", \"input_latency\": %s", latency.c_str());
+  }
+  if (perf_counters_enabled) {
+    appendf(&json_ptr, json_end, ", \"counters\": %s", counters.c_str());
+  }
+  appendf(&json_ptr, json_end, " }}]\n");
+
+  write_to_updates(json.data(), json_ptr - json.data(), false);
+}
+
+// The Python profile (-y), sent just before the bye.
+void
+write_profile() {
+  if (!profiler_enabled) {
+    return;
+  }
+
+  lock_code();
+  std::string profile = profiler_json();
+  unlock_code();
+
+  std::vector<char> json(256 + profile.size());
+  char* json_ptr = json.data();
+  char* json_end = json_ptr + json.size();
+  appendf(&json_ptr, json_end, "[{ \"type\": \"microbit_profile\", \"ticks\": %d, \"data\": %s }]\n",
+          get_macro_ticks(), profile.c_str());
+
+  write_to_updates(json.data(), json_ptr - json.data(), false);
+}
+
+void
+write_bye() {
+  char json[1024];
+  char* json_ptr = json;
+  char* json_end = json + sizeof(json);
+
+  appendf(&json_ptr, json_end,
+          "[{ \"type\": \"microbit_bye\", \"ticks\": %d, \"data\": { \"real_ticks\": \"%d\" }}]\n",
+          get_macro_ticks(), expected_macro_ticks());
 
   write_to_updates(json, json_ptr - json, false);
 }
 
 void
 write_event_ack(const char* event_type, const char* ack_data_json) {
-  char json[1024];
+  char json[12288];
   char* json_ptr = json;
   char* json_end = json + sizeof(json);
 
@@ -666,20 +1446,30 @@ write_event_ack(const char* event_type, const char* ack_data_json) {
   write_to_updates(json, json_ptr - json, false);
 }
 
+// Client events that change device state are handled by an apply function, which validates the
+// event data, updates the simulated hardware and formats the data for the event's ack (leaving
+// ack_json empty for an empty ack). If commit is false the event is only validated. The caller
+// must hold code_lock, and is responsible for signalling the code thread and writing the ack.
+// Returns false if the event was invalid.
+typedef bool (*client_event_apply_fn)(const json_value* data, bool commit, char* ack_json,
+                                      size_t ack_json_len);
+
 // Button updates are formatted as:
 // { id: <0 or 1>, state: <0 or 1> }
 // where 1 means 'down'.
-void
-process_client_button(const json_value* data) {
+bool
+apply_client_button(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* id = json_value_get(data, "id");
   const json_value* state = json_value_get(data, "state");
   if (!id || !state || id->type != JSON_VALUE_TYPE_NUMBER ||
       state->type != JSON_VALUE_TYPE_NUMBER) {
     fprintf(stderr, "Button event missing id and/or state\n");
-    return;
+    return false;
   }
 
-  pthread_mutex_lock(&code_lock);
+  if (!commit) {
+    return true;
+  }
 
   int pin = (id->as.number == 0) ? BUTTON_A : BUTTON_B;
   // Buttons have (external) pull-up resistors (so pressing the button sets the pin low).
@@ -690,87 +1480,85 @@ process_client_button(const json_value* data) {
   double v = (state->as.number == 0) ? 3.3 : 0;
   get_gpio_pin(pin).set_input_voltage(v);
 
-  pthread_mutex_unlock(&code_lock);
-
-  // Make the code thread run with the new state.
-  signal_interrupt();
-
-  write_event_ack("microbit_button", nullptr);
+  return true;
 }
 
 // Temperature updates are formatted as:
 // { t: <number> }
 // The values correspond to the values read by temperature().
-void
-process_client_temperature(const json_value* data) {
+bool
+apply_client_temperature(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* t = json_value_get(data, "t");
   if (!t || t->type != JSON_VALUE_TYPE_NUMBER) {
     fprintf(stderr, "Temperature event missing t.\n");
-    return;
+    return false;
   }
 
-  pthread_mutex_lock(&code_lock);
-  set_temperature(t->as.number);
-  pthread_mutex_unlock(&code_lock);
+  if (!commit) {
+    return true;
+  }
 
-  // Make the code thread run with the new state.
-  signal_interrupt();
+  set_temperature(t->as.number);
 
-  char ack_json[1024];
-  snprintf(ack_json, sizeof(ack_json), "{\"t\": %d}", static_cast<int32_t>(t->as.number));
-  write_event_ack("temperature", ack_json);
+  snprintf(ack_json, ack_json_len, "{\"t\": %d}", static_cast<int32_t>(t->as.number));
+  return true;
 }
 
+struct gesture_name_t {
+  const char* name;
+  BasicGesture gesture;
+};
+
+const gesture_name_t GESTURE_NAMES[] = {
+    {"up", GESTURE_UP},
+    {"down", GESTURE_DOWN},
+    {"left", GESTURE_LEFT},
+    {"right", GESTURE_RIGHT},
+    {"face up", GESTURE_FACE_UP},
+    {"face down", GESTURE_FACE_DOWN},
+    {"freefall", GESTURE_FREEFALL},
+    {"3g", GESTURE_3G},
+    {"6g", GESTURE_6G},
+    {"8g", GESTURE_8G},
+    {"shake", GESTURE_SHAKE},
+};
+
 BasicGesture
 get_gesture_from_name(const char* name) {
-  if (strcasecmp(name, "up") == 0) {
-    return GESTURE_UP;
-  }
-  if (strcasecmp(name, "down") == 0) {
-    return GESTURE_DOWN;
-  }
-  if (strcasecmp(name, "left") == 0) {
-    return GESTURE_LEFT;
-  }
-  if (strcasecmp(name, "right") == 0) {
-    return GESTURE_RIGHT;
-  }
-  if (strcasecmp(name, "face up") == 0) {
-    return GESTURE_FACE_UP;
-  }
-  if (strcasecmp(name, "face down") == 0) {
-    return GESTURE_FACE_DOWN;
-  }
-  if (strcasecmp(name, "freefall") == 0) {
-    return GESTURE_FREEFALL;
-  }
-  if (strcasecmp(name, "3g") == 0) {
-    return GESTURE_3G;
-  }
-  if (strcasecmp(name, "6g") == 0) {
-    return GESTURE_6G;
-  }
-  if (strcasecmp(name, "8g") == 0) {
-    return GESTURE_8G;
-  }
-  if (strcasecmp(name, "shake") == 0) {
-    return GESTURE_SHAKE;
+  for (size_t i = 0; i < sizeof(GESTURE_NAMES) / sizeof(GESTURE_NAMES[0]); ++i) {
+    if (strcasecmp(name, GESTURE_NAMES[i].name) == 0) {
+      return GESTURE_NAMES[i].gesture;
+    }
   }
   return GESTURE_NONE;
 }
 
+const char*
+get_gesture_name(BasicGesture gesture) {
+  for (size_t i = 0; i < sizeof(GESTURE_NAMES) / sizeof(GESTURE_NAMES[0]); ++i) {
+    if (GESTURE_NAMES[i].gesture == gesture) {
+      return GESTURE_NAMES[i].name;
+    }
+  }
+  return "";
+}
+
 // Accelerometer updates are formatted as:
 // { x: <number>, y: <number>, z: <number> }
 // The values correspond to the values read by accelerometer.get_*().
-void
-process_client_accel(const json_value* data) {
+bool
+apply_client_accel(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* x = json_value_get(data, "x");
   const json_value* y = json_value_get(data, "y");
   const json_value* z = json_value_get(data, "z");
   if (!x || !y || !z || x->type != JSON_VALUE_TYPE_NUMBER || y->type != JSON_VALUE_TYPE_NUMBER ||
       z->type != JSON_VALUE_TYPE_NUMBER) {
     fprintf(stderr, "Accelerometer event missing x/y/z.\n");
-    return;
+    return false;
+  }
+
+  if (!commit) {
+    return true;
   }
 
   BasicGesture g = GESTURE_NONE;
@@ -783,176 +1571,1405 @@ process_client_accel(const json_value* data) {
     }
   }
 
-  pthread_mutex_lock(&code_lock);
   set_accelerometer(x->as.number, y->as.number, z->as.number, g);
-  pthread_mutex_unlock(&code_lock);
-
-  // Make the code thread run with the new state.
-  signal_interrupt();
 
-  char ack_json[1024];
-  snprintf(ack_json, sizeof(ack_json), "{\"x\": %f, \"y\": %f, \"z\": %f, \"gesture\": \"%s\"}",
+  snprintf(ack_json, ack_json_len, "{\"x\": %f, \"y\": %f, \"z\": %f, \"gesture\": \"%s\"}",
            x->as.number, y->as.number, z->as.number, gesture_name);
-  write_event_ack("accelerometer", ack_json);
+  return true;
 }
 
 // Magnetometer updates are formatted as:
 // { x: <number>, y: <number>, z: <number> }
 // The values correspond to the values read by compass.get_*().
-void
-process_client_magnet(const json_value* data) {
+bool
+apply_client_magnet(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* x = json_value_get(data, "x");
   const json_value* y = json_value_get(data, "y");
   const json_value* z = json_value_get(data, "z");
   if (!x || !y || !z || x->type != JSON_VALUE_TYPE_NUMBER || y->type != JSON_VALUE_TYPE_NUMBER ||
       z->type != JSON_VALUE_TYPE_NUMBER) {
     fprintf(stderr, "Magnetometer event missing x/y/z.\n");
-    return;
+    return false;
   }
 
-  pthread_mutex_lock(&code_lock);
-  set_magnetometer(x->as.number, y->as.number, z->as.number);
-  pthread_mutex_unlock(&code_lock);
+  if (!commit) {
+    return true;
+  }
 
-  // Make the code thread run with the new state.
-  signal_interrupt();
+  set_magnetometer(x->as.number, y->as.number, z->as.number);
 
-  char ack_json[1024];
-  snprintf(ack_json, sizeof(ack_json), "{\"x\": %f, \"y\": %f, \"z\": %f}", x->as.number,
+  snprintf(ack_json, ack_json_len, "{\"x\": %f, \"y\": %f, \"z\": %f}", x->as.number,
            y->as.number, z->as.number);
-  write_event_ack("magnetometer", ack_json);
+  return true;
 }
 
 // Pin updates are formatted as:
 // { "pin": N, "voltage": V }
 // The voltage can be 'null' for disconnected.
-void
-process_client_pins(const json_value* data) {
+bool
+apply_client_pins(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* pin = json_value_get(data, "pin");
   const json_value* voltage = json_value_get(data, "voltage");
   if (!pin || !voltage || pin->type != JSON_VALUE_TYPE_NUMBER ||
       voltage->type != JSON_VALUE_TYPE_NUMBER) {
     fprintf(stderr, "Pin number or voltage missing.\n");
-    return;
+    return false;
   }
 
   int pin_mb = uint32_t(pin->as.number);
   if (pin_mb > 20) {
     fprintf(stderr, "Invalid pin number.\n");
-    return;
+    return false;
+  }
+
+  if (!commit) {
+    return true;
   }
 
   int pin_nrf = MICROBIT_PIN_MAP[pin_mb];
-  pthread_mutex_lock(&code_lock);
   get_gpio_pin(pin_nrf).set_input_voltage(voltage->as.number);
-  pthread_mutex_unlock(&code_lock);
 
-  // Make the code thread run with the new state.
-  signal_interrupt();
-
-  write_event_ack("microbit_pin", nullptr);
+  return true;
 }
 
-void
-process_client_radio_rx(const json_value* data) {
+bool
+apply_client_radio_rx(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
   const json_value* frame = json_value_get(data, "frame");
   const json_value* channel = json_value_get(data, "channel");
   const json_value* base = json_value_get(data, "base");
   const json_value* prefix = json_value_get(data, "prefix");
   const json_value* data_rate = json_value_get(data, "data_rate");
   const json_value* sender_id = json_value_get(data, "sender_id");
-  if (frame && channel && base && prefix && data_rate && frame->type == JSON_VALUE_TYPE_ARRAY &&
-      channel->type == JSON_VALUE_TYPE_NUMBER && base->type == JSON_VALUE_TYPE_NUMBER &&
-      prefix->type == JSON_VALUE_TYPE_NUMBER && data_rate->type == JSON_VALUE_TYPE_NUMBER) {
-    pthread_mutex_lock(&code_lock);
-    simulator_radio_frame_t f;
+  if (!frame || !channel || !base || !prefix || !data_rate ||
+      frame->type != JSON_VALUE_TYPE_ARRAY || channel->type != JSON_VALUE_TYPE_NUMBER ||
+      base->type != JSON_VALUE_TYPE_NUMBER || prefix->type != JSON_VALUE_TYPE_NUMBER ||
+      data_rate->type != JSON_VALUE_TYPE_NUMBER) {
+    fprintf(stderr, "micro:bit radio needs (frame, channel, base, prefix, data_rate).\n");
+    return false;
+  }
 
-    f.channel = channel->as.number;
-    f.base0 = base->as.number;
-    f.prefix0 = prefix->as.number;
-    f.data_rate = data_rate->as.number;
+  if (!commit) {
+    return true;
+  }
 
-    char ack_json[4096];
-    char* ack_json_ptr = ack_json;
-    char* ack_json_end = ack_json + sizeof(ack_json);
-    appendf(&ack_json_ptr, ack_json_end, "{\"frame\": [");
+  simulator_radio_frame_t f;
+
+  f.channel = channel->as.number;
+  f.base0 = base->as.number;
+  f.prefix0 = prefix->as.number;
+  f.data_rate = data_rate->as.number;
+
+  char* ack_json_ptr = ack_json;
+  char* ack_json_end = ack_json + ack_json_len;
+  appendf(&ack_json_ptr, ack_json_end, "{\"frame\": [");
 
-    const json_value_list* frame_bytes = frame->as.pairs;
-    while (frame_bytes && f.len < 2048) {
-      if (frame_bytes->value->type == JSON_VALUE_TYPE_NUMBER) {
-        uint8_t b = static_cast<uint8_t>(frame_bytes->value->as.number);
+  const json_value_list* frame_bytes = frame->as.pairs;
+  while (frame_bytes && f.len < sizeof(f.data)) {
+    if (frame_bytes->value->type == JSON_VALUE_TYPE_NUMBER) {
+      uint8_t b = static_cast<uint8_t>(frame_bytes->value->as.number);
 
-        f.data[f.len] = b;
-        ++f.len;
+      f.data[f.len] = b;
+      ++f.len;
+
+      appendf(&ack_json_ptr, ack_json_end, "%u,", b);
+    }
+    frame_bytes = frame_bytes->next;
+  }
 
-        appendf(&ack_json_ptr, ack_json_end, "%u,", b);
+  if (*(ack_json_ptr - 1) == ',') {
+    // Remove trailing comma.
+    ack_json_ptr -= 1;
+  }
+
+  appendf(&ack_json_ptr, ack_json_end,
+          "], \"channel\": %d, \"base\": %d, \"prefix\": %d, \"data_rate\": %d", f.channel,
+          f.base0, f.prefix0, f.data_rate);
+  if (sender_id && sender_id->type == JSON_VALUE_TYPE_NUMBER) {
+    appendf(&ack_json_ptr, ack_json_end, ", \"sender_id\": %d",
+            static_cast<int32_t>(sender_id->as.number));
+  }
+  appendf(&ack_json_ptr, ack_json_end, "}");
+
+  simulator_radio_add_rx(f);
+
+  return true;
+}
+
+bool
+apply_client_random(const json_value* data, bool commit, char* ack_json, size_t ack_json_len) {
+  const json_value* next = json_value_get(data, "next");
+  const json_value* repeat = json_value_get(data, "repeat");
+  const json_value* choice_count = json_value_get(data, "choice_count");
+  const json_value* choice_result = json_value_get(data, "choice_result");
+  if (next && repeat && next->type == JSON_VALUE_TYPE_NUMBER &&
+      repeat->type == JSON_VALUE_TYPE_NUMBER) {
+    if (commit) {
+      set_random_state(next->as.number, repeat->as.number);
+    }
+  } else if (choice_count && choice_result && choice_count->type == JSON_VALUE_TYPE_NUMBER &&
+             choice_result->type == JSON_VALUE_TYPE_STRING) {
+    if (commit) {
+      set_random_choice(choice_count->as.number, choice_result->as.string);
+    }
+  } else {
+    fprintf(stderr, "Random needs (next, repeat) or (choice_count, choice_result).\n");
+    return false;
+  }
+
+  return true;
+}
+
+struct client_event_handler_t {
+  // The event type, which is also used as the type of the ack.
+  const char* type;
+  client_event_apply_fn apply;
+  // Historically the radio acks even invalid frames (with empty data).
+  bool ack_invalid;
+};
+
+const client_event_handler_t CLIENT_EVENT_HANDLERS[] = {
+    {"microbit_button", &apply_client_button, false},
+    {"temperature", &apply_client_temperature, false},
+    {"accelerometer", &apply_client_accel, false},
+    {"magnetometer", &apply_client_magnet, false},
+    {"microbit_pin", &apply_client_pins, false},
+    {"microbit_radio_rx", &apply_client_radio_rx, true},
+    {"random", &apply_client_random, false},
+};
+
+const client_event_handler_t*
+find_client_event_handler(const char* type) {
+  for (size_t i = 0; i < sizeof(CLIENT_EVENT_HANDLERS) / sizeof(CLIENT_EVENT_HANDLERS[0]); ++i) {
+    if (strcmp(type, CLIENT_EVENT_HANDLERS[i].type) == 0) {
+      return &CLIENT_EVENT_HANDLERS[i];
+    }
+  }
+  return nullptr;
+}
+
+// A state-changing event from a line of client events, waiting to be applied with the rest of
+// the line.
+struct client_event_batch_item_t {
+  const client_event_handler_t* handler;
+  // Owned by the batch if it's deferred (see deferred_batches).
+  json_value* data;
+};
+
+// Serialize a JSON value (the json library only parses).
+void
+json_value_write(struct buffer* buf, const json_value* value) {
+  switch (value->type) {
+    case JSON_VALUE_TYPE_NULL:
+      buffer_append(buf, "null");
+      break;
+    case JSON_VALUE_TYPE_BOOLEAN:
+      buffer_append(buf, value->as.boolean ? "true" : "false");
+      break;
+    case JSON_VALUE_TYPE_NUMBER:
+      buffer_append_printf(buf, "%.17g", value->as.number);
+      break;
+    case JSON_VALUE_TYPE_STRING:
+      json_write_escape_string(buf, value->as.string);
+      break;
+    case JSON_VALUE_TYPE_ARRAY:
+    case JSON_VALUE_TYPE_OBJECT: {
+      bool is_object = value->type == JSON_VALUE_TYPE_OBJECT;
+      buffer_append(buf, is_object ? "{" : "[");
+      for (const json_value_list* pair = value->as.pairs; pair; pair = pair->next) {
+        if (pair != value->as.pairs) {
+          buffer_append(buf, ", ");
+        }
+        if (is_object) {
+          json_write_escape_string(buf, pair->key);
+          buffer_append(buf, ": ");
+        }
+        json_value_write(buf, pair->value);
       }
-      frame_bytes = frame_bytes->next;
+      buffer_append(buf, is_object ? "}" : "]");
+      break;
+    }
+  }
+}
+
+// Input traces (see -r and -R) are a header followed by a sequence of records:
+//   uint32_t ticks, uint8_t kind, uint32_t len, uint8_t payload[len]
+// with everything in host byte order.
+const char TRACE_MAGIC[4] = {'M', 'B', 'T', 'R'};
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_FLAG_DETERMINISTIC = 1;
+
+struct trace_header_t {
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t seed;
+};
+
+enum TraceRecordKind {
+  // Start of a simulator run (i.e. after each reset).
+  TRACE_RUN = 0,
+  // Bytes added to the serial input.
+  TRACE_SERIAL = 1,
+  // A batch of state-changing client events, as a JSON list in client event format.
+  TRACE_EVENTS = 2,
+  // A scheduled event, as { "index": N, "type": ..., "data": ... }.
+  TRACE_SCHEDULED = 3,
+  // The simulator shut down.
+  TRACE_END = 4,
+};
+
+// Open trace file (shared by all runs), and serial input waiting to be written as a single
+// record. Protected by code_lock.
+FILE* trace_record_file = nullptr;
+std::string trace_pending_serial;
+uint32_t trace_pending_serial_ticks = 0;
+
+void
+write_trace_record_raw(uint32_t ticks, TraceRecordKind kind, const void* payload, uint32_t len) {
+  uint8_t kind_byte = kind;
+  fwrite(&ticks, sizeof(ticks), 1, trace_record_file);
+  fwrite(&kind_byte, sizeof(kind_byte), 1, trace_record_file);
+  fwrite(&len, sizeof(len), 1, trace_record_file);
+  if (len > 0) {
+    fwrite(payload, 1, len, trace_record_file);
+  }
+}
+
+// Write any serial input collected so far as a single record.
+// Caller must hold code_lock.
+void
+flush_trace_serial() {
+  if (!trace_pending_serial.empty()) {
+    write_trace_record_raw(trace_pending_serial_ticks, TRACE_SERIAL, trace_pending_serial.data(),
+                           trace_pending_serial.size());
+    trace_pending_serial.clear();
+    fflush(trace_record_file);
+  }
+}
+
+// Caller must hold code_lock.
+void
+write_trace_record(TraceRecordKind kind, const void* payload, uint32_t len) {
+  if (!trace_record_file) {
+    return;
+  }
+  flush_trace_serial();
+  write_trace_record_raw(get_macro_ticks(), kind, payload, len);
+  // Flushed every time so that the trace survives the simulator being killed.
+  fflush(trace_record_file);
+}
+
+// Record a batch of client events as they're applied.
+// Caller must hold code_lock.
+void
+record_trace_events(const std::vector<client_event_batch_item_t>& batch, bool atomic) {
+  if (!trace_record_file) {
+    return;
+  }
+  struct buffer* json = buffer_create();
+  buffer_append(json, "[");
+  for (size_t i = 0; i < batch.size(); ++i) {
+    buffer_append_printf(json, "%s{\"type\": \"%s\", \"data\": ", i ? ", " : "",
+                         batch[i].handler->type);
+    json_value_write(json, batch[i].data);
+    buffer_append(json, "}");
+  }
+  if (atomic) {
+    buffer_append(json, ", {\"type\": \"batch\", \"data\": {\"atomic\": true}}");
+  }
+  buffer_append(json, "]");
+  write_trace_record(TRACE_EVENTS, json->data, json->nbytes_used);
+  buffer_destroy(json);
+}
+
+// Add a byte from the client to the serial input (recording it if necessary).
+// Caller must hold code_lock.
+void
+add_serial_input(uint8_t c) {
+  if (trace_record_file) {
+    if (!trace_pending_serial.empty() && trace_pending_serial_ticks != get_macro_ticks()) {
+      flush_trace_serial();
+    }
+    trace_pending_serial_ticks = get_macro_ticks();
+    trace_pending_serial.push_back(c);
+  }
+  serial_add_byte(c);
+}
+
+// Apply a batch of state-changing client events, and add the ack record to acks. A single event
+// gets the regular ack for its type. Otherwise, the ack is a "batch" ack listing the ack type and
+// data for each processed event, in order.
+// If atomic is set, every event is validated first and nothing is applied unless all are valid.
+// If input_json is given, it's added to the ack as "input" (see "Input latency" in README.md).
+// Caller must hold code_lock. Returns the number of events applied.
+int32_t
+apply_client_state_events(const std::vector<client_event_batch_item_t>& batch, bool atomic,
+                          struct buffer* acks, const char* input_json = nullptr) {
+  char ack_json[10240] = {0};
+
+  record_trace_events(batch, atomic);
+
+  if (batch.size() == 1 && !atomic) {
+    // Nothing to combine, so keep the regular ack for this event type.
+    const client_event_handler_t* handler = batch[0].handler;
+    bool valid = handler->apply(batch[0].data, true, ack_json, sizeof(ack_json));
+    if (valid || handler->ack_invalid) {
+      buffer_append_printf(acks,
+                           "[{ \"type\": \"microbit_ack\", \"ticks\": %d, \"data\": { \"type\": "
+                           "\"%s\", \"data\": %s%s%s }}]\n",
+                           get_macro_ticks(), handler->type,
+                           (valid && ack_json[0]) ? ack_json : "{}",
+                           input_json ? ", \"input\": " : "", input_json ? input_json : "");
+    }
+    return valid ? 1 : 0;
+  }
+
+  int32_t applied = 0;
+  int32_t rejected = 0;
+
+  buffer_append_printf(acks,
+                       "[{ \"type\": \"microbit_ack\", \"ticks\": %d, \"data\": { \"type\": "
+                       "\"batch\", \"data\": { \"events\": [",
+                       get_macro_ticks());
+
+  if (atomic) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!batch[i].handler->apply(batch[i].data, false, ack_json, sizeof(ack_json))) {
+        ++rejected;
+      }
+    }
+  }
+
+  if (rejected == 0) {
+    bool first = true;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      const client_event_handler_t* handler = batch[i].handler;
+      ack_json[0] = 0;
+      bool valid = handler->apply(batch[i].data, true, ack_json, sizeof(ack_json));
+      if (valid) {
+        ++applied;
+      } else {
+        ++rejected;
+      }
+      if (valid || handler->ack_invalid) {
+        buffer_append_printf(acks, "%s{\"type\": \"%s\", \"data\": %s}", first ? "" : ", ",
+                             handler->type, (valid && ack_json[0]) ? ack_json : "{}");
+        first = false;
+      }
+    }
+  }
+
+  buffer_append_printf(acks, "], \"applied\": %d, \"rejected\": %d, \"atomic\": %s%s%s }}}]\n",
+                       applied, rejected, atomic ? "true" : "false",
+                       input_json ? ", \"input\": " : "", input_json ? input_json : "");
+
+  return applied;
+}
+
+// In deterministic mode, input from the client (state changes and serial data) isn't applied as
+// it arrives (which could be at any point in the code thread's execution). Instead it waits here
+// until the ticker next fires. Protected by code_lock.
+struct deferred_batch_t {
+  std::vector<client_event_batch_item_t> events;
+  bool atomic;
+};
+std::vector<deferred_batch_t> deferred_batches;
+std::string deferred_serial_input;
+
+// Apply all of the state-changing client events from one line under a single acquisition of
+// code_lock (so the code thread sees them all at once), then deliver a single interrupt and write
+// a single ack. input is the line's stamp, if input latency is being tracked.
+void
+process_client_state_events(const std::vector<client_event_batch_item_t>& batch, bool atomic,
+                            const client_input_t* input) {
+  if (batch.empty() || replay_mode) {
+    // (In replay mode, all input comes from the trace.)
+    return;
+  }
+
+  if (deterministic_mode) {
+    deferred_batch_t deferred;
+    deferred.events = batch;
+    deferred.atomic = atomic;
+    lock_code();
+    deferred_batches.push_back(deferred);
+    unlock_code();
+    return;
+  }
+
+  struct buffer* acks = buffer_create();
+
+  lock_code();
+  uint64_t applied_ns = 0;
+  char input_json[128] = {0};
+  if (input) {
+    applied_ns = perf_now_ns();
+    if (input_latency_records) {
+      snprintf(input_json, sizeof(input_json), "{\"id\": %u, \"apply_us\": %llu}", input->id,
+               (unsigned long long)((applied_ns - input->arrival_ns) / 1000));
+    }
+  }
+  int32_t applied =
+      apply_client_state_events(batch, atomic, acks, input_json[0] ? input_json : nullptr);
+  if (applied && input) {
+    track_input_latency(*input, applied_ns);
+  }
+  unlock_code();
+
+  if (applied) {
+    // Make the code thread run with the new state.
+    signal_interrupt();
+  }
+
+  if (acks->nbytes_used) {
+    write_to_updates(acks->data, acks->nbytes_used, false);
+  }
+  buffer_destroy(acks);
+}
+
+// Called by the ticker (holding code_lock) in deterministic mode to apply the client input that
+// has arrived since it last fired. Acks are added to acks.
+void
+apply_deferred_input(struct buffer* acks) {
+  for (size_t i = 0; i < deferred_batches.size(); ++i) {
+    const deferred_batch_t& deferred = deferred_batches[i];
+    apply_client_state_events(deferred.events, deferred.atomic, acks);
+    for (size_t j = 0; j < deferred.events.size(); ++j) {
+      json_value_destroy(deferred.events[j].data);
+    }
+  }
+  deferred_batches.clear();
+
+  for (size_t i = 0; i < deferred_serial_input.size(); ++i) {
+    add_serial_input(deferred_serial_input[i]);
+  }
+  deferred_serial_input.clear();
+}
+
+// Take ownership of the value for the given key in a JSON object, leaving null in its place.
+json_value*
+json_value_take(json_value* object, const char* key) {
+  for (json_value_list* pair = object->as.pairs; pair; pair = pair->next) {
+    if (strcmp(pair->key, key) == 0) {
+      json_value* value = pair->value;
+      pair->value = json_value_create(JSON_VALUE_TYPE_NULL);
+      return value;
+    }
+  }
+  return nullptr;
+}
+
+// Whether a query asked for the given subsystem (or for everything).
+bool
+query_wants(const json_value* subsystems, const char* name) {
+  if (!subsystems || subsystems->type != JSON_VALUE_TYPE_ARRAY) {
+    return true;
+  }
+  for (const json_value_list* s = subsystems->as.pairs; s; s = s->next) {
+    if (s->value->type == JSON_VALUE_TYPE_STRING && strcmp(s->value->as.string, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Query events ask for a full snapshot of the current device state, formatted as:
+// { "subsystems": [ "leds", "pins", "radio", "accelerometer", "magnetometer", "temperature",
+//                   "random" ], "id": N }
+// All subsystems are included if the list is omitted. The reply is a microbit_state record
+// (echoing the optional id), written immediately rather than waiting for the next macro tick.
+void
+process_client_query(const json_value* data) {
+  const json_value* subsystems = json_value_get(data, "subsystems");
+  const json_value* id = json_value_get(data, "id");
+
+  uint32_t leds[25] = {0};
+  uint32_t pins[23] = {0};
+  uint32_t pwm_dutycycle[23] = {0};
+  uint32_t pwm_period[23] = {0};
+  bool radio_enabled = false;
+  uint8_t radio_channel = 0;
+  uint32_t radio_base0 = 0;
+  uint8_t radio_prefix0 = 0;
+  uint8_t radio_data_rate = 0;
+  int16_t accel_x = 0, accel_y = 0, accel_z = 0;
+  BasicGesture gesture = GESTURE_NONE;
+  int32_t magnet_x = 0, magnet_y = 0, magnet_z = 0;
+  int32_t temperature = 0;
+  int32_t random_next = 0;
+  int32_t random_remaining = 0;
+  int32_t random_choice_count = 0;
+  const char* random_choice_result = nullptr;
+
+  lock_code();
+  read_led_state(leds);
+  read_gpio_state(pins, pwm_dutycycle, pwm_period);
+  simulator_radio_get_config(&radio_enabled, &radio_channel, &radio_base0, &radio_prefix0,
+                             &radio_data_rate);
+  get_accelerometer(&accel_x, &accel_y, &accel_z, &gesture);
+  get_magnetometer(&magnet_x, &magnet_y, &magnet_z);
+  get_temperature(&temperature);
+  bool random_injected = get_random_state(&random_next, &random_remaining);
+  if (!get_random_choice(&random_choice_count, &random_choice_result)) {
+    random_choice_count = 0;
+  }
+  uint32_t ticks = get_macro_ticks();
+  unlock_code();
+
+  char json[4096];
+  char* json_ptr = json;
+  char* json_end = json + sizeof(json);
+
+  appendf(&json_ptr, json_end, "[{ \"type\": \"microbit_state\", \"ticks\": %d, \"data\": {",
+          ticks);
+  if (id && id->type == JSON_VALUE_TYPE_NUMBER) {
+    appendf(&json_ptr, json_end, "\"id\": %d, ", static_cast<int32_t>(id->as.number));
+  }
+  appendf(&json_ptr, json_end, "\"ticks\": %d", ticks);
+
+  if (query_wants(subsystems, "leds")) {
+    appendf(&json_ptr, json_end, ", \"leds\": {");
+    list_to_json("b", &json_ptr, json_end, leds, sizeof(leds) / sizeof(uint32_t));
+    appendf(&json_ptr, json_end, "}");
+  }
+  if (query_wants(subsystems, "pins")) {
+    appendf(&json_ptr, json_end, ", \"pins\": {");
+    list_to_json("p", &json_ptr, json_end, pins, sizeof(pins) / sizeof(uint32_t));
+    appendf(&json_ptr, json_end, ", ");
+    list_to_json("pwmd", &json_ptr, json_end, pwm_dutycycle,
+                 sizeof(pwm_dutycycle) / sizeof(uint32_t));
+    appendf(&json_ptr, json_end, ", ");
+    list_to_json("pwmp", &json_ptr, json_end, pwm_period, sizeof(pwm_period) / sizeof(uint32_t));
+    appendf(&json_ptr, json_end, "}");
+  }
+  if (query_wants(subsystems, "radio")) {
+    appendf(&json_ptr, json_end,
+            ", \"radio\": { \"enabled\": %s, \"channel\": %d, \"base\": %d, \"prefix\": %d, "
+            "\"data_rate\": %d }",
+            radio_enabled ? "true" : "false", radio_channel, radio_base0, radio_prefix0,
+            radio_data_rate);
+  }
+  if (query_wants(subsystems, "accelerometer")) {
+    appendf(&json_ptr, json_end,
+            ", \"accelerometer\": { \"x\": %d, \"y\": %d, \"z\": %d, \"gesture\": \"%s\" }",
+            accel_x, accel_y, accel_z, get_gesture_name(gesture));
+  }
+  if (query_wants(subsystems, "magnetometer")) {
+    appendf(&json_ptr, json_end, ", \"magnetometer\": { \"x\": %d, \"y\": %d, \"z\": %d }",
+            magnet_x, magnet_y, magnet_z);
+  }
+  if (query_wants(subsystems, "temperature")) {
+    appendf(&json_ptr, json_end, ", \"temperature\": { \"t\": %d }", temperature);
+  }
+  if (query_wants(subsystems, "random")) {
+    appendf(&json_ptr, json_end,
+            ", \"random\": { \"injected\": %s, \"next\": %d, \"remaining\": %d, \"exceeded\": %s, "
+            "\"choice_count\": %d }",
+            random_injected ? "true" : "false", random_next, random_remaining,
+            random_remaining < 0 ? "true" : "false", random_choice_count);
+  }
+
+  appendf(&json_ptr, json_end, "}}]\n");
+
+  write_reply_to_updates(json, json_ptr - json);
+}
+
+// Session events change how updates are sent to this client, formatted as:
+// { "push": <bool>, "latency": <bool> }
+// Setting push to false stops device state changes being pushed, for clients that only use
+// query events. Setting latency to true adds input timings to acks and sends a
+// microbit_input_latency record when each input produces output.
+void
+process_client_session(const json_value* data) {
+  const json_value* push = json_value_get(data, "push");
+  if (push && push->type == JSON_VALUE_TYPE_BOOLEAN) {
+    push_updates = push->as.boolean;
+  }
+  const json_value* latency = json_value_get(data, "latency");
+  if (latency && latency->type == JSON_VALUE_TYPE_BOOLEAN) {
+    lock_code();
+    input_latency_records = input_latency_enabled && latency->as.boolean;
+    unlock_code();
+  }
+
+  char ack_json[1024];
+  snprintf(ack_json, sizeof(ack_json), "{\"push\": %s, \"latency\": %s}",
+           push_updates ? "true" : "false", input_latency_records ? "true" : "false");
+  write_event_ack("session", ack_json);
+}
+
+// Assertion events upload predicates for the simulator to check itself, formatted as:
+// { "assertions": [ { "id": N, "kind": "<kind>", ..., "op": "<op>", "value": V,
+//                     "mode": "eventually" | "always", "from": T0, "until": T1 }, ... ],
+//   "relative": <bool>, "clear": <bool> }
+// Kinds (and their extra fields) are:
+//   led: "x", "y" -- brightness (0-9)
+//   pin: "pin", "field" ("state", "pwmd" or "pwmp") -- as in microbit_pins
+//   radio: "field" ("enabled", "channel", "base", "prefix" or "data_rate") -- radio config
+//   radio_tx: optional "frame" -- a frame (matching exactly, if given) is sent
+//   serial: "text" -- the text appears in serial output
+// Ops are ==, !=, <, <=, > and >= (ignored for radio_tx and serial).
+// Each assertion is checked on every macro tick between from and until (inclusive, relative to
+// now if relative is set). An "eventually" assertion passes the first time it holds, and times out
+// at until. An "always" assertion fails the first time it doesn't hold, and passes at until.
+// Results are sent in microbit_assert records.
+enum AssertionKind {
+  ASSERT_LED,
+  ASSERT_PIN,
+  ASSERT_RADIO,
+  ASSERT_RADIO_TX,
+  ASSERT_SERIAL,
+};
+
+enum AssertionOp {
+  ASSERT_OP_EQ,
+  ASSERT_OP_NE,
+  ASSERT_OP_LT,
+  ASSERT_OP_LE,
+  ASSERT_OP_GT,
+  ASSERT_OP_GE,
+};
+
+struct assertion_t {
+  int32_t id;
+  AssertionKind kind;
+  AssertionOp op;
+  bool always;
+  uint32_t from_ticks;
+  uint32_t until_ticks;
+  // LED index, pin number, or field (for pins and radio).
+  int32_t index;
+  int32_t field;
+  int64_t value;
+  // The most recently observed value (reported on failure/timeout).
+  int64_t observed;
+  // For radio_tx, the frame to match (any frame if empty). For serial, the text to find.
+  std::string expected;
+  // For radio_tx, set when a matching frame was sent since the last check.
+  bool seen;
+  // For serial, the end of the output so far (enough to match text that spans ticks).
+  std::string serial_tail;
+};
+
+// Active assertions, protected by code_lock.
+std::vector<assertion_t> assertions;
+// Serial output since the last check (only collected while there are serial assertions).
+bool assertion_serial_active = false;
+std::string assertion_serial_output;
+
+const char* const PIN_ASSERT_FIELDS[] = {"state", "pwmd", "pwmp"};
+const char* const RADIO_ASSERT_FIELDS[] = {"enabled", "channel", "base", "prefix", "data_rate"};
+
+// Returns the index of name in the list of fields, or -1.
+int32_t
+find_assertion_field(const json_value* name, const char* const* fields, size_t len) {
+  if (!name || name->type != JSON_VALUE_TYPE_STRING) {
+    return -1;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (strcmp(name->as.string, fields[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool
+parse_assertion_op(const json_value* op, AssertionOp* result) {
+  static const struct {
+    const char* name;
+    AssertionOp op;
+  } ops[] = {
+      {"==", ASSERT_OP_EQ}, {"!=", ASSERT_OP_NE}, {"<", ASSERT_OP_LT},
+      {"<=", ASSERT_OP_LE}, {">", ASSERT_OP_GT},  {">=", ASSERT_OP_GE},
+  };
+  if (!op) {
+    *result = ASSERT_OP_EQ;
+    return true;
+  }
+  if (op->type != JSON_VALUE_TYPE_STRING) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+    if (strcmp(op->as.string, ops[i].name) == 0) {
+      *result = ops[i].op;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fill in an assertion from its JSON description. Returns false if it's invalid.
+bool
+parse_assertion(const json_value* json, uint32_t base_ticks, assertion_t* a) {
+  if (json->type != JSON_VALUE_TYPE_OBJECT) {
+    return false;
+  }
+  const json_value* id = json_value_get(json, "id");
+  const json_value* kind = json_value_get(json, "kind");
+  const json_value* value = json_value_get(json, "value");
+  const json_value* mode = json_value_get(json, "mode");
+  const json_value* from = json_value_get(json, "from");
+  const json_value* until = json_value_get(json, "until");
+  if (!id || !kind || !until || id->type != JSON_VALUE_TYPE_NUMBER ||
+      kind->type != JSON_VALUE_TYPE_STRING || until->type != JSON_VALUE_TYPE_NUMBER) {
+    return false;
+  }
+
+  a->id = id->as.number;
+  a->always = mode && mode->type == JSON_VALUE_TYPE_STRING && strcmp(mode->as.string, "always") == 0;
+  a->from_ticks = base_ticks;
+  if (from && from->type == JSON_VALUE_TYPE_NUMBER) {
+    a->from_ticks += static_cast<uint32_t>(from->as.number);
+  }
+  a->until_ticks = base_ticks + static_cast<uint32_t>(until->as.number);
+  a->index = 0;
+  a->field = 0;
+  a->value = (value && value->type == JSON_VALUE_TYPE_NUMBER) ? value->as.number : 0;
+  a->observed = 0;
+  a->seen = false;
+  if (!parse_assertion_op(json_value_get(json, "op"), &a->op)) {
+    return false;
+  }
+
+  if (strcmp(kind->as.string, "led") == 0) {
+    const json_value* x = json_value_get(json, "x");
+    const json_value* y = json_value_get(json, "y");
+    if (!x || !y || x->type != JSON_VALUE_TYPE_NUMBER || y->type != JSON_VALUE_TYPE_NUMBER ||
+        x->as.number < 0 || x->as.number > 4 || y->as.number < 0 || y->as.number > 4) {
+      return false;
+    }
+    a->kind = ASSERT_LED;
+    a->index = static_cast<int32_t>(y->as.number) * 5 + static_cast<int32_t>(x->as.number);
+  } else if (strcmp(kind->as.string, "pin") == 0) {
+    const json_value* pin = json_value_get(json, "pin");
+    if (!pin || pin->type != JSON_VALUE_TYPE_NUMBER || pin->as.number < 0 ||
+        pin->as.number > 22) {
+      return false;
+    }
+    a->kind = ASSERT_PIN;
+    a->index = pin->as.number;
+    a->field = find_assertion_field(json_value_get(json, "field"), PIN_ASSERT_FIELDS,
+                                    sizeof(PIN_ASSERT_FIELDS) / sizeof(PIN_ASSERT_FIELDS[0]));
+    if (a->field == -1) {
+      return false;
+    }
+  } else if (strcmp(kind->as.string, "radio") == 0) {
+    a->kind = ASSERT_RADIO;
+    a->field = find_assertion_field(json_value_get(json, "field"), RADIO_ASSERT_FIELDS,
+                                    sizeof(RADIO_ASSERT_FIELDS) / sizeof(RADIO_ASSERT_FIELDS[0]));
+    if (a->field == -1) {
+      return false;
+    }
+  } else if (strcmp(kind->as.string, "radio_tx") == 0) {
+    a->kind = ASSERT_RADIO_TX;
+    const json_value* frame = json_value_get(json, "frame");
+    if (frame && frame->type == JSON_VALUE_TYPE_ARRAY) {
+      for (const json_value_list* b = frame->as.pairs; b; b = b->next) {
+        if (b->value->type == JSON_VALUE_TYPE_NUMBER) {
+          a->expected.push_back(static_cast<char>(static_cast<uint8_t>(b->value->as.number)));
+        }
+      }
+    }
+  } else if (strcmp(kind->as.string, "serial") == 0) {
+    const json_value* text = json_value_get(json, "text");
+    if (!text || text->type != JSON_VALUE_TYPE_STRING || text->as.string[0] == 0) {
+      return false;
+    }
+    a->kind = ASSERT_SERIAL;
+    a->expected = text->as.string;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void
+observe_serial_output(uint8_t c) {
+  // Bounded in case the ticker isn't running (the tail of each assertion is all that matters).
+  if (assertion_serial_active && assertion_serial_output.size() < 65536) {
+    assertion_serial_output.push_back(c);
+  }
+  result_cache_capture(RESULT_CACHE_STDOUT, &c, 1);
+  attribute_input_latency(LATENCY_SERIAL);
+}
+
+// Called by check_radio_tx (holding code_lock) for every frame sent.
+void
+observe_radio_tx(const simulator_radio_frame_t& f) {
+  for (size_t i = 0; i < assertions.size(); ++i) {
+    assertion_t& a = assertions[i];
+    if (a.kind == ASSERT_RADIO_TX &&
+        (a.expected.empty() ||
+         (a.expected.size() == f.len && memcmp(a.expected.data(), f.data, f.len) == 0))) {
+      a.seen = true;
+    }
+  }
+}
+
+void
+update_serial_output_observer() {
+  bool want_serial = false;
+  for (size_t i = 0; i < assertions.size(); ++i) {
+    if (assertions[i].kind == ASSERT_SERIAL) {
+      want_serial = true;
+    }
+  }
+  if (!want_serial) {
+    assertion_serial_output.clear();
+  }
+  assertion_serial_active = want_serial;
+  // Serial output is also needed to fill the result cache, and to measure input latency.
+  set_serial_output_observer((want_serial || result_cache_capturing() || input_latency_enabled)
+                                 ? &observe_serial_output
+                                 : nullptr);
+}
+
+void
+process_client_assert(const json_value* data) {
+  const json_value* list = json_value_get(data, "assertions");
+  const json_value* relative = json_value_get(data, "relative");
+  const json_value* clear = json_value_get(data, "clear");
+  if (!list || list->type != JSON_VALUE_TYPE_ARRAY) {
+    fprintf(stderr, "Assert event missing assertions.\n");
+    return;
+  }
+
+  uint32_t base_ticks = 0;
+  if (relative && relative->type == JSON_VALUE_TYPE_BOOLEAN && relative->as.boolean) {
+    base_ticks = get_macro_ticks();
+  }
+
+  int32_t count = 0;
+  int32_t invalid = 0;
+
+  lock_code();
+
+  if (clear && clear->type == JSON_VALUE_TYPE_BOOLEAN && clear->as.boolean) {
+    assertions.clear();
+  }
+
+  for (const json_value_list* item = list->as.pairs; item; item = item->next) {
+    assertion_t a;
+    if (parse_assertion(item->value, base_ticks, &a)) {
+      assertions.push_back(a);
+      ++count;
+    } else {
+      ++invalid;
+    }
+  }
+
+  update_serial_output_observer();
+
+  unlock_code();
+
+  char ack_json[1024];
+  snprintf(ack_json, sizeof(ack_json), "{\"count\": %d, \"invalid\": %d}", count, invalid);
+  write_event_ack("assert", ack_json);
+}
+
+bool
+compare_assertion_value(AssertionOp op, int64_t observed, int64_t expected) {
+  switch (op) {
+    case ASSERT_OP_EQ:
+      return observed == expected;
+    case ASSERT_OP_NE:
+      return observed != expected;
+    case ASSERT_OP_LT:
+      return observed < expected;
+    case ASSERT_OP_LE:
+      return observed <= expected;
+    case ASSERT_OP_GT:
+      return observed > expected;
+    case ASSERT_OP_GE:
+      return observed >= expected;
+  }
+  return false;
+}
+
+// Check every active assertion against the current device state, and send the results of any
+// that have finished. Called by the ticker on each macro tick.
+void
+evaluate_assertions() {
+  uint32_t leds[25] = {0};
+  uint32_t pins[23] = {0};
+  uint32_t pwm_dutycycle[23] = {0};
+  uint32_t pwm_period[23] = {0};
+  uint32_t radio[5] = {0};
+
+  bool has_results = false;
+
+  lock_code();
+
+  if (assertions.empty()) {
+    unlock_code();
+    return;
+  }
+
+  struct buffer* json = buffer_create();
+
+  uint32_t ticks = get_macro_ticks();
+
+  read_led_state(leds);
+  read_gpio_state(pins, pwm_dutycycle, pwm_period);
+  bool radio_enabled = false;
+  uint8_t radio_channel = 0;
+  uint8_t radio_prefix0 = 0;
+  uint8_t radio_data_rate = 0;
+  simulator_radio_get_config(&radio_enabled, &radio_channel, &radio[2], &radio_prefix0,
+                             &radio_data_rate);
+  radio[0] = radio_enabled;
+  radio[1] = radio_channel;
+  radio[3] = radio_prefix0;
+  radio[4] = radio_data_rate;
+
+  buffer_append_printf(json,
+                       "[{ \"type\": \"microbit_assert\", \"ticks\": %d, \"data\": { \"results\": [",
+                       ticks);
+
+  std::vector<assertion_t>::iterator it = assertions.begin();
+  while (it != assertions.end()) {
+    assertion_t& a = *it;
+    bool holds = false;
+    switch (a.kind) {
+      case ASSERT_LED:
+        a.observed = leds[a.index];
+        holds = compare_assertion_value(a.op, a.observed, a.value);
+        break;
+      case ASSERT_PIN:
+        a.observed = (a.field == 0) ? pins[a.index]
+                                    : (a.field == 1) ? pwm_dutycycle[a.index] : pwm_period[a.index];
+        holds = compare_assertion_value(a.op, a.observed, a.value);
+        break;
+      case ASSERT_RADIO:
+        a.observed = radio[a.field];
+        holds = compare_assertion_value(a.op, a.observed, a.value);
+        break;
+      case ASSERT_RADIO_TX:
+        holds = a.seen;
+        a.observed = a.seen;
+        a.seen = false;
+        break;
+      case ASSERT_SERIAL:
+        a.serial_tail += assertion_serial_output;
+        holds = a.serial_tail.find(a.expected) != std::string::npos;
+        a.observed = holds;
+        if (a.serial_tail.size() >= a.expected.size()) {
+          a.serial_tail.erase(0, a.serial_tail.size() - a.expected.size() + 1);
+        }
+        break;
+    }
+
+    const char* result = nullptr;
+    if (ticks >= a.from_ticks) {
+      if (!a.always && holds) {
+        result = "pass";
+      } else if (a.always && !holds) {
+        result = "fail";
+      } else if (ticks >= a.until_ticks) {
+        result = a.always ? "pass" : "timeout";
+      }
+    }
+
+    if (result) {
+      buffer_append_printf(json, "%s{\"id\": %d, \"result\": \"%s\", \"value\": %lld}",
+                           has_results ? ", " : "", a.id, result,
+                           static_cast<long long>(a.observed));
+      has_results = true;
+      it = assertions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  assertion_serial_output.clear();
+  if (has_results) {
+    update_serial_output_observer();
+  }
+
+  unlock_code();
+
+  if (has_results) {
+    buffer_append_printf(json, "]}}]\n");
+    write_to_updates(json->data, json->nbytes_used, false);
+  }
+  buffer_destroy(json);
+}
+
+// Schedule events upload a timeline of future client events, formatted as:
+// { "events": [ { "ticks": T, "type": "<event type>", "data": { ... } }, ... ],
+//   "relative": <bool>, "clear": <bool> }
+// Each event is applied by the ticker as soon as it reaches macro tick T (or T macro ticks from now
+// if relative is set). Instead of individual acks, a microbit_schedule record lists the indices of
+// the events applied on each tick. Setting clear discards anything still pending.
+void
+process_client_schedule(json_value* data) {
+  const json_value* events = json_value_get(data, "events");
+  const json_value* relative = json_value_get(data, "relative");
+  const json_value* clear = json_value_get(data, "clear");
+  if (!events || events->type != JSON_VALUE_TYPE_ARRAY) {
+    fprintf(stderr, "Schedule event missing events.\n");
+    return;
+  }
+
+  uint32_t base_ticks = 0;
+  if (relative && relative->type == JSON_VALUE_TYPE_BOOLEAN && relative->as.boolean) {
+    base_ticks = get_macro_ticks();
+  }
+
+  lock_code();
+
+  if (clear && clear->type == JSON_VALUE_TYPE_BOOLEAN && clear->as.boolean) {
+    for (size_t i = 0; i < scheduled_events.size(); ++i) {
+      json_value_destroy(scheduled_events[i].data);
+    }
+    scheduled_events.clear();
+  }
+
+  int32_t count = 0;
+  int32_t invalid = 0;
+  int32_t index = 0;
+  for (json_value_list* event = events->as.pairs; event; event = event->next, ++index) {
+    const json_value* ticks = nullptr;
+    const json_value* event_type = nullptr;
+    const client_event_handler_t* handler = nullptr;
+    if (event->value->type == JSON_VALUE_TYPE_OBJECT) {
+      ticks = json_value_get(event->value, "ticks");
+      event_type = json_value_get(event->value, "type");
+    }
+    if (event_type && event_type->type == JSON_VALUE_TYPE_STRING) {
+      handler = find_client_event_handler(event_type->as.string);
+    }
+    json_value* event_data = handler ? json_value_take(event->value, "data") : nullptr;
+    if (!ticks || ticks->type != JSON_VALUE_TYPE_NUMBER || !event_data ||
+        event_data->type != JSON_VALUE_TYPE_OBJECT) {
+      json_value_destroy(event_data);
+      ++invalid;
+      continue;
+    }
+
+    scheduled_event_t e;
+    e.ticks = base_ticks + static_cast<uint32_t>(ticks->as.number);
+    e.index = index;
+    e.handler = handler;
+    e.data = event_data;
+
+    // Keep the timeline sorted, with events for the same tick in the order they were sent.
+    std::vector<scheduled_event_t>::iterator it = scheduled_events.begin();
+    while (it != scheduled_events.end() && it->ticks <= e.ticks) {
+      ++it;
+    }
+    scheduled_events.insert(it, e);
+    ++count;
+  }
+
+  unlock_code();
+
+  char ack_json[1024];
+  snprintf(ack_json, sizeof(ack_json), "{\"count\": %d, \"invalid\": %d}", count, invalid);
+  write_event_ack("schedule", ack_json);
+}
+
+// Called by the ticker (holding code_lock) to apply any scheduled events that are now due.
+// The indices of the applied (and invalid) events are added to the given lists.
+void
+apply_scheduled_events(std::vector<int32_t>* applied, std::vector<int32_t>* failed) {
+  size_t n = 0;
+  while (n < scheduled_events.size() && scheduled_events[n].ticks <= get_macro_ticks()) {
+    scheduled_event_t& e = scheduled_events[n];
+    char ack_json[10240];
+    if (trace_record_file) {
+      struct buffer* json = buffer_create();
+      buffer_append_printf(json, "{\"index\": %d, \"type\": \"%s\", \"data\": ", e.index,
+                           e.handler->type);
+      json_value_write(json, e.data);
+      buffer_append(json, "}");
+      write_trace_record(TRACE_SCHEDULED, json->data, json->nbytes_used);
+      buffer_destroy(json);
+    }
+    if (e.handler->apply(e.data, true, ack_json, sizeof(ack_json))) {
+      applied->push_back(e.index);
+    } else {
+      failed->push_back(e.index);
+    }
+    json_value_destroy(e.data);
+    ++n;
+  }
+  scheduled_events.erase(scheduled_events.begin(), scheduled_events.begin() + n);
+}
+
+// Written like an ack: it doesn't suspend fast mode or count as output in lockstep mode.
+void
+write_schedule_update(const std::vector<int32_t>& applied, const std::vector<int32_t>& failed) {
+  struct buffer* json = buffer_create();
+
+  buffer_append_printf(json, "[{ \"type\": \"microbit_schedule\", \"ticks\": %d, \"data\": {",
+                       get_macro_ticks());
+
+  buffer_append_printf(json, "\"applied\": [");
+  for (size_t i = 0; i < applied.size(); ++i) {
+    buffer_append_printf(json, i ? ",%d" : "%d", applied[i]);
+  }
+  buffer_append_printf(json, "], \"failed\": [");
+  for (size_t i = 0; i < failed.size(); ++i) {
+    buffer_append_printf(json, i ? ",%d" : "%d", failed[i]);
+  }
+  buffer_append_printf(json, "]}}]\n");
+
+  write_to_updates(json->data, json->nbytes_used, false);
+  buffer_destroy(json);
+}
+
+// A record loaded from a trace for replay (-R).
+struct trace_record_t {
+  // Which run (i.e. child process, see main()) the record belongs to.
+  uint32_t run;
+  uint32_t ticks;
+  TraceRecordKind kind;
+  std::string payload;
+};
+
+// Every record in the trace (loaded by the parent process before the first run), and the next one
+// to replay in this run. Protected by code_lock.
+std::vector<trace_record_t> replay_records;
+size_t replay_next = 0;
+
+// Load a trace for replay, returning false if it can't be read. Also restores deterministic mode
+// if the trace was recorded with it.
+bool
+load_trace(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror("open trace");
+    return false;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      header.version != TRACE_VERSION) {
+    fprintf(stderr, "Not a valid input trace: %s\n", path);
+    fclose(f);
+    return false;
+  }
+
+  if (header.flags & TRACE_FLAG_DETERMINISTIC) {
+    deterministic_mode = true;
+    deterministic_seed = header.seed;
+  }
+
+  uint32_t run = 0;
+  bool seen_run = false;
+  while (true) {
+    uint32_t ticks = 0;
+    uint8_t kind = 0;
+    uint32_t len = 0;
+    if (fread(&ticks, sizeof(ticks), 1, f) != 1 || fread(&kind, sizeof(kind), 1, f) != 1 ||
+        fread(&len, sizeof(len), 1, f) != 1) {
+      break;
+    }
+    trace_record_t record;
+    record.ticks = ticks;
+    record.kind = static_cast<TraceRecordKind>(kind);
+    record.payload.resize(len);
+    if (len > 0 && fread(&record.payload[0], 1, len, f) != len) {
+      // Truncated (e.g. the recording simulator was killed mid-write).
+      break;
+    }
+    if (record.kind == TRACE_RUN) {
+      if (seen_run) {
+        ++run;
+      }
+      seen_run = true;
+    }
+    record.run = run;
+    replay_records.push_back(record);
+  }
+
+  fclose(f);
+  return true;
+}
+
+// Parse a recorded batch of client events into a batch. Returns false if it isn't valid.
+bool
+parse_trace_events(json_value* json, std::vector<client_event_batch_item_t>* batch,
+                   bool* atomic) {
+  if (json->type != JSON_VALUE_TYPE_ARRAY) {
+    return false;
+  }
+  *atomic = false;
+  for (json_value_list* event = json->as.pairs; event; event = event->next) {
+    if (event->value->type != JSON_VALUE_TYPE_OBJECT) {
+      continue;
     }
-
-    if (*(ack_json_ptr - 1) == ',') {
-      // Remove trailing comma.
-      ack_json_ptr -= 1;
+    const json_value* event_type = json_value_get(event->value, "type");
+    json_value* event_data = json_value_get(event->value, "data");
+    if (!event_type || !event_data || event_type->type != JSON_VALUE_TYPE_STRING) {
+      continue;
     }
-
-    appendf(&ack_json_ptr, ack_json_end,
-            "], \"channel\": %d, \"base\": %d, \"prefix\": %d, \"data_rate\": %d", f.channel,
-            f.base0, f.prefix0, f.data_rate);
-    if (sender_id && sender_id->type == JSON_VALUE_TYPE_NUMBER) {
-      appendf(&ack_json_ptr, ack_json_end, ", \"sender_id\": %d",
-              static_cast<int32_t>(sender_id->as.number));
+    if (strcmp(event_type->as.string, "batch") == 0) {
+      *atomic = true;
+    } else if (const client_event_handler_t* handler =
+                   find_client_event_handler(event_type->as.string)) {
+      client_event_batch_item_t item = {handler, event_data};
+      batch->push_back(item);
     }
-    appendf(&ack_json_ptr, ack_json_end, "}");
+  }
+  return true;
+}
 
-    simulator_radio_add_rx(f);
-    pthread_mutex_unlock(&code_lock);
+// Get ready to replay this run's part of the trace. Scheduled events go straight into the
+// timeline (so they produce the same microbit_schedule records), everything else is applied by
+// the ticker.
+void
+start_replay_run() {
+  replay_next = 0;
+  while (replay_next < replay_records.size() && replay_records[replay_next].run < simulator_run) {
+    ++replay_next;
+  }
 
-    // Make the code thread run with the new state.
-    signal_interrupt();
+  for (size_t i = replay_next;
+       i < replay_records.size() && replay_records[i].run == simulator_run; ++i) {
+    const trace_record_t& record = replay_records[i];
+    if (record.kind != TRACE_SCHEDULED) {
+      continue;
+    }
+    json_value* json = json_parse_n(record.payload.data(), record.payload.size());
+    if (!json) {
+      continue;
+    }
+    const json_value* index = json_value_get(json, "index");
+    const json_value* event_type = json_value_get(json, "type");
+    const client_event_handler_t* handler = nullptr;
+    if (event_type && event_type->type == JSON_VALUE_TYPE_STRING) {
+      handler = find_client_event_handler(event_type->as.string);
+    }
+    if (handler && index && index->type == JSON_VALUE_TYPE_NUMBER) {
+      scheduled_event_t e;
+      e.ticks = record.ticks;
+      e.index = index->as.number;
+      e.handler = handler;
+      e.data = json_value_take(json, "data");
+      scheduled_events.push_back(e);
+    }
+    json_value_destroy(json);
+  }
+}
 
-    write_event_ack("microbit_radio_rx", ack_json);
-  } else {
-    fprintf(stderr, "micro:bit radio needs (frame, channel, base, prefix, data_rate).\n");
-    write_event_ack("microbit_radio_rx", nullptr);
+// Called by the ticker (holding code_lock) in replay mode to apply the input recorded up to the
+// current macro tick. Acks are added to acks.
+void
+apply_replay_input(struct buffer* acks) {
+  while (replay_next < replay_records.size() &&
+         replay_records[replay_next].run == simulator_run &&
+         replay_records[replay_next].ticks <= get_macro_ticks()) {
+    const trace_record_t& record = replay_records[replay_next];
+    ++replay_next;
+
+    if (record.kind == TRACE_SERIAL) {
+      for (size_t i = 0; i < record.payload.size(); ++i) {
+        serial_add_byte(record.payload[i]);
+      }
+    } else if (record.kind == TRACE_EVENTS) {
+      json_value* json = json_parse_n(record.payload.data(), record.payload.size());
+      std::vector<client_event_batch_item_t> batch;
+      bool atomic = false;
+      if (json && parse_trace_events(json, &batch, &atomic) && !batch.empty()) {
+        apply_client_state_events(batch, atomic, acks);
+      }
+      json_value_destroy(json);
+    } else if (record.kind == TRACE_END) {
+      // The recorded session ended here (without the program finishing by itself).
+      shutdown = true;
+    }
   }
 }
 
+// Lockstep advance events are formatted as:
+// { "ticks": N } or { "until_output": true, "ticks": N }
+// The first form runs exactly N macro ticks. The second runs until the end of the first macro tick
+// that produces a device update, or N macro ticks (default 1000), whichever comes first.
+// Advancing while a window is already open extends that window.
 void
-process_client_random(const json_value* data) {
-  const json_value* next = json_value_get(data, "next");
-  const json_value* repeat = json_value_get(data, "repeat");
-  const json_value* choice_count = json_value_get(data, "choice_count");
-  const json_value* choice_result = json_value_get(data, "choice_result");
-  if (next && repeat && next->type == JSON_VALUE_TYPE_NUMBER &&
-      repeat->type == JSON_VALUE_TYPE_NUMBER) {
-    pthread_mutex_lock(&code_lock);
-    set_random_state(next->as.number, repeat->as.number);
-    pthread_mutex_unlock(&code_lock);
-  } else if (choice_count && choice_result && choice_count->type == JSON_VALUE_TYPE_NUMBER &&
-             choice_result->type == JSON_VALUE_TYPE_STRING) {
-    pthread_mutex_lock(&code_lock);
-    set_random_choice(choice_count->as.number, choice_result->as.string);
-    pthread_mutex_unlock(&code_lock);
-  } else {
-    fprintf(stderr, "Random needs (next, repeat) or (choice_count, choice_result).\n");
+process_client_advance(const json_value* data) {
+  if (!lockstep_mode) {
+    fprintf(stderr, "Advance event ignored (not in lockstep mode).\n");
     return;
   }
 
-  // Make the code thread run with the new state.
-  signal_interrupt();
+  const json_value* ticks = json_value_get(data, "ticks");
+  const json_value* until_output = json_value_get(data, "until_output");
+  bool wait_for_output = until_output && until_output->type == JSON_VALUE_TYPE_BOOLEAN &&
+                         until_output->as.boolean;
+  uint32_t n = wait_for_output ? 1000 : 0;
+  if (ticks && ticks->type == JSON_VALUE_TYPE_NUMBER && ticks->as.number > 0) {
+    n = ticks->as.number;
+  } else if (!wait_for_output) {
+    fprintf(stderr, "Advance event needs ticks and/or until_output.\n");
+    return;
+  }
+
+  pthread_mutex_lock(&lockstep_lock);
+  if (!lockstep_window_open) {
+    lockstep_end_ticks = get_macro_ticks();
+    lockstep_output_seen = false;
+  }
+  lockstep_end_ticks += n;
+  lockstep_until_output = wait_for_output;
+
+  // Ack before opening the window, so the ack is sent with the window it opened (or extended).
+  char ack_json[64];
+  snprintf(ack_json, sizeof(ack_json), "{\"end_ticks\": %u, \"until_output\": %s}",
+           lockstep_end_ticks, wait_for_output ? "true" : "false");
+  write_event_ack("advance", ack_json);
+
+  lockstep_window_open = true;
+  pthread_cond_broadcast(&lockstep_wait);
+  pthread_mutex_unlock(&lockstep_lock);
+}
 
-  write_event_ack("random", nullptr);
+// Count a client event (by its type, which must be one we know, so it's safe to put in JSON).
+void
+count_client_event_type(const char* type) {
+  if (perf_counters_enabled) {
+    perf_count_type(PERF_GROUP_CLIENT_EVENTS, type, strlen(type), 0);
+  }
 }
 
 // Handle an array of json events that we read from the pipe/file.
 // All json events are at a minimum:
 //   { "type": "<string>", "data": { <object> } }
+// input is the line's stamp, if input latency is being tracked.
 void
-process_client_json(const json_value* json) {
+process_client_json(json_value* json, const client_input_t* input) {
+  timeline_scope_t span("process_client_json");
   if (json->type != JSON_VALUE_TYPE_ARRAY) {
     fprintf(stderr, "Client event JSON wasn't a list.\n");
   }
-  const json_value_list* event = json->as.pairs;
+
+  // A line can opt in to atomic application of its state changes with:
+  // { "type": "batch", "data": { "atomic": true } }
+  bool atomic = false;
+  for (const json_value_list* event = json->as.pairs; event; event = event->next) {
+    if (event->value->type != JSON_VALUE_TYPE_OBJECT) {
+      continue;
+    }
+    const json_value* event_type = json_value_get(event->value, "type");
+    const json_value* event_data = json_value_get(event->value, "data");
+    if (event_type && event_data && event_type->type == JSON_VALUE_TYPE_STRING &&
+        event_data->type == JSON_VALUE_TYPE_OBJECT && strcmp(event_type->as.string, "batch") == 0) {
+      const json_value* batch_atomic = json_value_get(event_data, "atomic");
+      atomic = batch_atomic && batch_atomic->type == JSON_VALUE_TYPE_BOOLEAN &&
+               batch_atomic->as.boolean;
+    }
+  }
+
+  // State changes are collected and applied together. Control events take effect in order, so
+  // anything collected before one is applied first.
+  std::vector<client_event_batch_item_t> batch;
+
+  json_value_list* event = json->as.pairs;
   while (event) {
     if (event->value->type != JSON_VALUE_TYPE_OBJECT) {
       fprintf(stderr, "Event should be an object.\n");
@@ -960,43 +2977,60 @@ process_client_json(const json_value* json) {
       continue;
     }
     const json_value* event_type = json_value_get(event->value, "type");
-    const json_value* event_data = json_value_get(event->value, "data");
+    json_value* event_data = json_value_get(event->value, "data");
     if (!event_type || !event_data || event_type->type != JSON_VALUE_TYPE_STRING ||
         event_data->type != JSON_VALUE_TYPE_OBJECT) {
       fprintf(stderr, "Event missing type and/or data.\n");
+    } else if (const client_event_handler_t* handler =
+                   find_client_event_handler(event_type->as.string)) {
+      // Buttons, sensors, pins, radio and injected random data.
+      // Deferred events outlive this line, so take ownership of their data (in replay mode live
+      // input is dropped, so it's never deferred).
+      bool deferred = deterministic_mode && !replay_mode;
+      client_event_batch_item_t item = {
+          handler, deferred ? json_value_take(event->value, "data") : event_data};
+      batch.push_back(item);
+      count_client_event_type(handler->type);
+    } else if (strcmp(event_type->as.string, "batch") == 0) {
+      // Options for this line, handled above.
     } else {
+      process_client_state_events(batch, atomic, input);
+      batch.clear();
+
       if (strncmp(event_type->as.string, "resume", 6) == 0) {
+        count_client_event_type("resume");
         pthread_mutex_lock(&suspend_lock);
         suspend = false;
         pthread_cond_broadcast(&suspend_wait);
         pthread_mutex_unlock(&suspend_lock);
-      } else if (strncmp(event_type->as.string, "microbit_button", 15) == 0) {
-        // Button state change.
-        process_client_button(event_data);
-      } else if (strncmp(event_type->as.string, "temperature", 15) == 0) {
-        // Temperature change.
-        process_client_temperature(event_data);
-      } else if (strncmp(event_type->as.string, "accelerometer", 13) == 0) {
-        // Accelerometer values change.
-        process_client_accel(event_data);
-      } else if (strncmp(event_type->as.string, "magnetometer", 12) == 0) {
-        // Compass values change.
-        process_client_magnet(event_data);
-      } else if (strncmp(event_type->as.string, "microbit_pin", 13) == 0) {
-        // Something driving the GPIO pins.
-        process_client_pins(event_data);
-      } else if (strncmp(event_type->as.string, "microbit_radio_rx", 13) == 0) {
-        // Radio data.
-        process_client_radio_rx(event_data);
-      } else if (strncmp(event_type->as.string, "random", 13) == 0) {
-        // Injected random data (from the marker only).
-        process_client_random(event_data);
+      } else if (strncmp(event_type->as.string, "advance", 7) == 0) {
+        count_client_event_type("advance");
+        // Lockstep time advance.
+        process_client_advance(event_data);
+      } else if (strncmp(event_type->as.string, "schedule", 8) == 0) {
+        count_client_event_type("schedule");
+        // Timeline of future events, applied by the ticker.
+        process_client_schedule(event_data);
+      } else if (strcmp(event_type->as.string, "query") == 0) {
+        count_client_event_type("query");
+        // Snapshot of the current state.
+        process_client_query(event_data);
+      } else if (strcmp(event_type->as.string, "session") == 0) {
+        count_client_event_type("session");
+        // Options for this client.
+        process_client_session(event_data);
+      } else if (strcmp(event_type->as.string, "assert") == 0) {
+        count_client_event_type("assert");
+        // Predicates to check on every macro tick.
+        process_client_assert(event_data);
       } else {
         fprintf(stderr, "Unknown event type: %s\n", event_type->as.string);
       }
     }
     event = event->next;
   }
+
+  process_client_state_events(batch, atomic, input);
 }
 
 // Handle an epoll event from either the pipe or the file.
@@ -1011,13 +3045,16 @@ process_client_event(int fd) {
   }
   buf[len] = 0;
 
+  uint64_t arrival_ns = input_latency_enabled ? perf_now_ns() : 0;
+
   char* line_start = buf;
   while (*line_start) {
     char* line_end = strchrnul(line_start, '\n');
 
     json_value* json = json_parse_n(line_start, line_end - line_start);
     if (json) {
-      process_client_json(json);
+      client_input_t input = {next_input_id++, arrival_ns};
+      process_client_json(json, input_latency_enabled ? &input : nullptr);
       json_value_destroy(json);
     } else {
       fprintf(stderr, "Invalid JSON\n");
@@ -1037,13 +3074,49 @@ process_client_event(int fd) {
 // until the next call.
 uint32_t
 handle_timerfd_event(uint32_t ticks) {
+  timeline_scope_t span("handle_timerfd_event");
   static uint32_t macroticks_last_led_update = 0;
+  std::vector<int32_t> scheduled_applied;
+  std::vector<int32_t> scheduled_failed;
 
-  pthread_mutex_lock(&code_lock);
+  struct buffer* deferred_acks = nullptr;
+
+  perf_count(PERF_TIMER_FIRES);
+
+  lock_code();
   ticks = fire_ticker(ticks);
-  pthread_mutex_unlock(&code_lock);
+  nvmc_tick();
+  if (profiler_enabled) {
+    profiler_tick(get_macro_ticks(), vm_in_wfi);
+  }
+  if (!deferred_batches.empty() || !deferred_serial_input.empty()) {
+    deferred_acks = buffer_create();
+    apply_deferred_input(deferred_acks);
+  }
+  if (replay_mode) {
+    if (!deferred_acks) {
+      deferred_acks = buffer_create();
+    }
+    apply_replay_input(deferred_acks);
+  }
+  if (!scheduled_events.empty()) {
+    apply_scheduled_events(&scheduled_applied, &scheduled_failed);
+  }
+  unlock_code();
 
-  if (!fast_mode) {
+  if (deferred_acks) {
+    if (deferred_acks->nbytes_used) {
+      write_to_updates(deferred_acks->data, deferred_acks->nbytes_used, false);
+    }
+    buffer_destroy(deferred_acks);
+  }
+
+  if (!scheduled_applied.empty() || !scheduled_failed.empty()) {
+    write_schedule_update(scheduled_applied, scheduled_failed);
+  }
+
+  // Scheduled events change the device state, so the code thread runs with it even in fast mode.
+  if (!fast_mode || !scheduled_applied.empty()) {
     signal_interrupt();
   }
 
@@ -1054,20 +3127,109 @@ handle_timerfd_event(uint32_t ticks) {
     check_marker_failure_updates();
     check_radio_tx();
     check_radio_config();
+    publish_shared_state();
+    evaluate_assertions();
+    if (input_latency_records) {
+      write_input_latency_updates();
+    }
 
     macroticks_last_led_update = get_macro_ticks();
   }
 
   // Periodically heartbeat if the '-t' flag is enabled.
   // This is useful for the marker to ensure that it sees an event at least every N ticks.
-  if (heartbeat_mode && get_macro_ticks() >= last_heartbeat + HEARTBEAT_TICKS) {
+  if (heartbeat_mode && push_updates && get_macro_ticks() >= last_heartbeat + HEARTBEAT_TICKS) {
     last_heartbeat = get_macro_ticks();
     write_heartbeat();
   }
 
+  if (perf_counters_enabled && perf_stats_interval &&
+      get_macro_ticks() >= last_perf_stats + perf_stats_interval) {
+    last_perf_stats = get_macro_ticks();
+    write_stats();
+  }
+
   return ticks;
 }
 
+// Close the current lockstep window and send everything produced during it.
+// Caller must hold lockstep_lock.
+void
+end_lockstep_window(const char* reason) {
+  lockstep_window_open = false;
+
+  char json[1024];
+  char* json_ptr = json;
+  char* json_end = json + sizeof(json);
+
+  appendf(&json_ptr, json_end,
+          "[{ \"type\": \"microbit_lockstep\", \"ticks\": %d, \"data\": { \"reason\": \"%s\" }}]\n",
+          get_macro_ticks(), reason);
+
+  pthread_mutex_lock(&updates_file_lock);
+  append_to_lockstep_batch(json, json_ptr - json);
+  flush_lockstep_batch();
+  pthread_mutex_unlock(&updates_file_lock);
+}
+
+// In lockstep mode, block until an advance window is open, then fire the ticker once.
+void
+lockstep_advance_ticker() {
+  if (single_threaded) {
+    while (!lockstep_window_open && !shutdown) {
+      vm_yield(VM_WAIT_LOCKSTEP);
+    }
+  } else {
+    pthread_mutex_lock(&lockstep_lock);
+    while (!lockstep_window_open && !shutdown) {
+      pthread_cond_wait(&lockstep_wait, &lockstep_lock);
+    }
+    pthread_mutex_unlock(&lockstep_lock);
+  }
+
+  if (shutdown) {
+    return;
+  }
+
+  fast_mode_ticks_until_fire_timer = handle_timerfd_event(fast_mode_ticks_until_fire_timer);
+
+  // Decide whether the window is over and close it in one critical section, so an advance that
+  // arrives meanwhile either extends this window or opens the next one (with its ack in that
+  // window's line), rather than being lost.
+  pthread_mutex_lock(&lockstep_lock);
+  if (get_macro_ticks() >= lockstep_end_ticks) {
+    end_lockstep_window("ticks");
+  } else if (lockstep_until_output && lockstep_output_seen) {
+    end_lockstep_window("output");
+  }
+  pthread_mutex_unlock(&lockstep_lock);
+}
+
+// In fast mode the code thread drives the ticker itself (from WFI and the branch hook).
+// Unless we're in lockstep mode, pause here while the marker has us suspended.
+void
+fast_mode_advance_ticker() {
+  if (lockstep_mode) {
+    lockstep_advance_ticker();
+    return;
+  }
+
+  fast_mode_ticks_until_fire_timer = handle_timerfd_event(fast_mode_ticks_until_fire_timer);
+
+  if (single_threaded) {
+    if (suspend) {
+      vm_yield(VM_WAIT_SUSPEND);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&suspend_lock);
+  if (suspend) {
+    pthread_cond_wait(&suspend_wait, &suspend_lock);
+  }
+  pthread_mutex_unlock(&suspend_lock);
+}
+
 // Run the timer with no real sleeps, just simulating the timer events.
 // This is used to flush out any LED updates on shutdown, and to fastforward past
 // native code that is blocking a Ctrl-C being handled.
@@ -1099,6 +3261,12 @@ main_thread() {
   const int MAX_EVENTS = 10;
   int epoll_fd = epoll_create1(0);
 
+  // Let blocked update writes wait for EPOLLOUT.
+  pthread_mutex_lock(&updates_file_lock);
+  updates_epoll_fd = epoll_fd;
+  drain_updates_queue();
+  pthread_mutex_unlock(&updates_file_lock);
+
   // Add non-blocking stdin to epoll set.
   struct epoll_event ev_stdin;
   fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL, 0) | O_NONBLOCK);
@@ -1159,8 +3327,24 @@ main_thread() {
   int epoll_timeout = fast_mode ? 50 : 50;
 
   while (!shutdown) {
+    // In single-threaded mode, run the VM until it next waits, then poll for events (without
+    // blocking if the VM can carry on).
+    bool vm_runnable = false;
+    if (single_threaded) {
+      if (vm_ready()) {
+        timeline_scope_t span("vm");
+        host_context_resume();
+        if (shutdown) {
+          break;
+        }
+      }
+      vm_runnable = vm_ready();
+    }
+
     struct epoll_event events[MAX_EVENTS];
-    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, epoll_timeout);
+    uint64_t wait_start = timeline_begin();
+    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, vm_runnable ? 0 : epoll_timeout);
+    timeline_end("epoll_wait", wait_start);
 
     if (nfds == -1) {
       if (errno == EINTR) {
@@ -1180,9 +3364,13 @@ main_thread() {
       sigint_requested = false;
 
       // Deliver a Ctrl-C to the serial input.
-      pthread_mutex_lock(&code_lock);
-      serial_add_byte(0x03);
-      pthread_mutex_unlock(&code_lock);
+      lock_code();
+      if (deterministic_mode) {
+        deferred_serial_input.push_back(0x03);
+      } else {
+        add_serial_input(0x03);
+      }
+      unlock_code();
 
       // Make sure microbit-micropython does something with it.
       signal_pending_since = get_macro_ticks();
@@ -1191,7 +3379,10 @@ main_thread() {
       signal_interrupt();
     }
     // And check how long it's been since we delivered a Ctrl-C or Ctrl-D.
-    if (signal_pending_since > 0 && signal_pending_since + 20 < get_macro_ticks()) {
+    // (In deterministic mode, the code thread always drives the ticker itself, so this can't happen,
+    // and fast-forwarding from this thread would make the output depend on thread timing.)
+    if (!deterministic_mode && signal_pending_since > 0 &&
+        signal_pending_since + 20 < get_macro_ticks()) {
       // We attempted to deliver a Ctrl-C or Ctrl-D but code hasn't executed in the past
       // 20 macro ticks, so it's probably stuck in the unhandled exception marquee display.
       signal_pending_since = 0;
@@ -1215,18 +3406,22 @@ main_thread() {
         // Input from stdin.
         uint8_t buf[10240];
         ssize_t len = read(STDIN_FILENO, &buf, sizeof(buf));
-        if (len == -1) {
+        if (len == -1 || replay_mode) {
           continue;
         }
-        pthread_mutex_lock(&code_lock);
+        lock_code();
         for (ssize_t i = 0; i < len; ++i) {
           if (buf[i] == 0x04) {
             // Make sure that the Ctrl-D gets handled by something.
             signal_pending_since = get_macro_ticks();
           }
-          serial_add_byte(buf[i]);
+          if (deterministic_mode) {
+            deferred_serial_input.push_back(buf[i]);
+          } else {
+            add_serial_input(buf[i]);
+          }
         }
-        pthread_mutex_unlock(&code_lock);
+        unlock_code();
         signal_interrupt();
       } else if (notify_fd != -1 && events[n].data.fd == notify_fd) {
         // A change occured to the ___client_events file.
@@ -1246,6 +3441,11 @@ main_thread() {
       } else if (events[n].data.fd == client_fd) {
         // A write happened to the client events pipe.
         process_client_event(client_fd);
+      } else if (events[n].data.fd == updates_fd) {
+        // The client has caught up enough to take more updates.
+        pthread_mutex_lock(&updates_file_lock);
+        drain_updates_queue();
+        pthread_mutex_unlock(&updates_file_lock);
       } else if (events[n].data.fd == timer_fd) {
         // Timer callback.
         uint64_t t;
@@ -1274,19 +3474,53 @@ main_thread() {
     }
   }
 
+  lock_code();
+  write_trace_record(TRACE_END, nullptr, 0);
+  unlock_code();
+
   // Keep running the timer for 20 more macro ticks (simulates ~120ms of time passing) so
   // that any pending LED and GPIO updates get sent out.
   fastforward_timer(20, false);
+
+  if (fs_export_dir) {
+    lock_code();
+    microbit_fs_export(fs_export_dir);
+    unlock_code();
+  }
+
+  write_stats();
+  write_profile();
   write_bye();
 
+  if (lockstep_mode) {
+    // Send whatever is left of the final window (including the bye), and release the code thread
+    // if it's waiting for another advance.
+    pthread_mutex_lock(&updates_file_lock);
+    flush_lockstep_batch();
+    pthread_mutex_unlock(&updates_file_lock);
+
+    pthread_mutex_lock(&lockstep_lock);
+    pthread_cond_broadcast(&lockstep_wait);
+    pthread_mutex_unlock(&lockstep_lock);
+  }
+
   signal_interrupt();
 
+  pthread_mutex_lock(&updates_file_lock);
+  if (updates_epoll_armed) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, updates_fd, NULL);
+    updates_epoll_armed = false;
+  }
+  updates_epoll_fd = -1;
+  pthread_mutex_unlock(&updates_file_lock);
+
   if (notify_fd != -1) {
     close(notify_fd);
   }
 
   close(client_fd);
   close(timer_fd);
+  close(epoll_fd);
 }
 
 // Makes STDIN non-blocking.
@@ -1332,7 +3566,13 @@ run_simulator() {
   get_gpio_pin(BUTTON_A).set_input_voltage(3.3);
   get_gpio_pin(BUTTON_B).set_input_voltage(3.3);
 
-  srand(time(NULL));
+  set_entropy_seed(deterministic_mode ? deterministic_seed : time(NULL));
+
+  if (perf_counters_enabled) {
+    perf_counters_start();
+  }
+
+  timeline_thread_name("main");
 
   // Install an INT handler so that we can make Ctrl-C clean up nicely.
   struct sigaction sa;
@@ -1352,37 +3592,86 @@ run_simulator() {
 
   pthread_mutex_init(&updates_file_lock, NULL);
 
-  // Open the events pipe.
-  char* updates_pipe_str = getenv("GROK_UPDATES_PIPE");
-  if (updates_pipe_str != NULL) {
-    updates_fd = atoi(updates_pipe_str);
-  } else {
-    updates_fd = open("___device_updates", O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  updates_fd = open_updates_fd();
+  fcntl(updates_fd, F_SETFL, fcntl(updates_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  open_shared_state();
+
+  write_trace_record(TRACE_RUN, nullptr, 0);
+  if (replay_mode) {
+    start_replay_run();
   }
+  update_serial_output_observer();
 
   pthread_cond_init(&suspend_wait, NULL);
   pthread_mutex_init(&suspend_lock, NULL);
 
+  pthread_cond_init(&lockstep_wait, NULL);
+  pthread_mutex_init(&lockstep_lock, NULL);
+  lockstep_batch = buffer_create();
+  buffer_append(lockstep_batch, "[");
+
   if (heartbeat_mode) {
     write_heartbeat();
   }
 
-  // Create the code thread.
-  pthread_t code_thread;
-  pthread_create(&code_thread, NULL, &code_thread_main, NULL);
+  if (single_threaded) {
+    // The VM context doesn't start running until the event loop resumes it.
+    if (!host_context_create(&vm_context_main, VM_STACK_SIZE)) {
+      return 1;
+    }
+    main_thread();
+
+    // Let the VM see the shutdown flag and unwind.
+    while (!host_context_finished()) {
+      interrupt_pending = true;
+      host_context_resume();
+    }
+    host_context_destroy();
+  } else {
+    // Create the code thread.
+    pthread_t code_thread;
+    pthread_create(&code_thread, NULL, &code_thread_main, NULL);
 
-  // Run the main thread (on the main thread).
-  main_thread();
+    // Run the main thread (on the main thread).
+    main_thread();
 
-  // After main terminates, join on all other threads.
-  void* code_thread_result;
-  pthread_join(code_thread, &code_thread_result);
+    // After main terminates, join on all other threads.
+    void* code_thread_result;
+    pthread_join(code_thread, &code_thread_result);
+  }
 
   pthread_mutex_destroy(&suspend_lock);
   pthread_cond_destroy(&suspend_wait);
 
+  for (size_t i = 0; i < scheduled_events.size(); ++i) {
+    json_value_destroy(scheduled_events[i].data);
+  }
+  scheduled_events.clear();
+  assertions.clear();
+  for (size_t i = 0; i < deferred_batches.size(); ++i) {
+    for (size_t j = 0; j < deferred_batches[i].events.size(); ++j) {
+      json_value_destroy(deferred_batches[i].events[j].data);
+    }
+  }
+  deferred_batches.clear();
+
+  buffer_destroy(lockstep_batch);
+  pthread_mutex_destroy(&lockstep_lock);
+  pthread_cond_destroy(&lockstep_wait);
+
+  // Anything the client hasn't taken yet (including the bye) must still be delivered.
+  pthread_mutex_lock(&updates_file_lock);
+  flush_updates_queue_blocking();
+  pthread_mutex_unlock(&updates_file_lock);
+
+  result_cache_flush();
+  timeline_write(simulator_run);
+
   close(updates_fd);
   pthread_mutex_destroy(&updates_file_lock);
+  close_shared_state();
+  sync_flash(true);
 
   // Clean up mutexes / condvars and the starting script.
   pthread_cond_destroy(&interrupt_signal);
@@ -1413,9 +3702,190 @@ typedef struct _appended_script_t {
 
 // Our modification to mprun.c expects to find one of these.
 char* initial_script;
+
+// Compiled form of the initial script, stored in flash after the source (see -b in README.md).
+typedef struct _compiled_script_t {
+  byte header[2];  // "MC"
+  uint16_t reserved;
+  uint32_t len;         // length of the bytecode
+  uint32_t compile_us;  // how long the bytecode originally took to compile
+  byte data[];          // .mpy format bytecode
+} compiled_script_t;
+}
+
+// Where the compiled script goes in flash: word-aligned after the script source, if it fits.
+compiled_script_t*
+get_compiled_script_slot(size_t len) {
+  appended_script_t* script = reinterpret_cast<appended_script_t*>(initial_script);
+  size_t offset = (sizeof(appended_script_t) + script->len + 1 + 3) & ~3;
+  if (offset + sizeof(compiled_script_t) + len > MAX_SCRIPT_SIZE) {
+    return nullptr;
+  }
+  return reinterpret_cast<compiled_script_t*>(initial_script + offset);
+}
+
+compiled_script_t*
+get_compiled_script() {
+  compiled_script_t* compiled = get_compiled_script_slot(0);
+  if (!compiled || compiled->header[0] != 'M' || compiled->header[1] != 'C') {
+    return nullptr;
+  }
+  return compiled;
+}
+
+void
+write_compiled_script(const void* bytecode, size_t len, uint32_t compile_us) {
+  compiled_script_t* compiled = get_compiled_script_slot(len);
+  if (!compiled) {
+    return;
+  }
+  compiled->len = len;
+  compiled->compile_us = compile_us;
+  memcpy(compiled->data, bytecode, len);
+  compiled->header[0] = 'M';
+  compiled->header[1] = 'C';
+}
+
+// Copy the compiled script from the on-disk cache into flash (unless it's already there). Done in
+// the parent before each run, so that resets also pick up bytecode compiled by an earlier run.
+void
+load_compiled_script() {
+  if (!bytecode_cache_enabled() || get_compiled_script()) {
+    return;
+  }
+  std::string bytecode;
+  uint32_t compile_us = 0;
+  if (bytecode_cache_load(&bytecode, &compile_us)) {
+    write_compiled_script(bytecode.data(), bytecode.size(), compile_us);
+  }
+}
+
+// Report whether the compiled script was used, and how much compile time that saved.
+void
+write_startup_stats(bool hit, uint32_t compile_us) {
+  // Compile times vary from run to run.
+  if (deterministic_mode) {
+    return;
+  }
+
+  char json[1024];
+  char* json_ptr = json;
+  char* json_end = json + sizeof(json);
+
+  appendf(&json_ptr, json_end, "[{ \"type\": \"microbit_startup\", \"ticks\": %d, \"data\": { ",
+          get_macro_ticks());
+  appendf(&json_ptr, json_end,
+          "\"bytecode_cache\": \"%s\", \"compile_us\": %u, \"compile_us_saved\": %u",
+          hit ? "hit" : "miss", hit ? 0 : compile_us, hit ? compile_us : 0);
+  appendf(&json_ptr, json_end, " }}]\n");
+
+  write_to_updates(json, json_ptr - json, false);
+}
+
+extern "C" {
+// Called by mprun.c before compiling the initial script. Returns the bytecode stored in flash (if
+// any), which the VM loads instead of compiling the source.
+const void*
+simulated_dal_get_compiled_script(size_t* len) {
+  if (!bytecode_cache_enabled()) {
+    return nullptr;
+  }
+  compiled_script_t* compiled = get_compiled_script();
+  if (!compiled) {
+    return nullptr;
+  }
+  write_startup_stats(true, compiled->compile_us);
+  *len = compiled->len;
+  return compiled->data;
+}
+
+// Called by mprun.c after compiling the initial script (when no bytecode was found), with the
+// .mpy format bytecode and the time taken to compile it.
+void
+simulated_dal_store_compiled_script(const void* bytecode, size_t len, uint32_t compile_us) {
+  if (!bytecode_cache_enabled()) {
+    return;
+  }
+  write_startup_stats(false, compile_us);
+  bytecode_cache_store(bytecode, len, compile_us);
+  write_compiled_script(bytecode, len, compile_us);
+}
 }
 
 uint32_t __data_end__ = 0;
+
+// Map the simulated flash. It's always a shared mapping, so that the runs forked by the reset loop
+// all see the same flash (like a real reset, which keeps the filesystem). If path is given, flash
+// is backed by that file, so it also persists between invocations.
+bool
+map_flash(const char* path) {
+  int fd = -1;
+  int flags = MAP_SHARED | MAP_ANONYMOUS;
+#if UINTPTR_MAX > 0xffffffff && defined(MAP_32BIT)
+  // Keep flash addresses valid as 32-bit pointers (see flash_address in Hardware.h).
+  int low_flag = MAP_32BIT;
+#else
+  int low_flag = 0;
+#endif
+  if (path) {
+    fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+      perror("open flash");
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (static_cast<size_t>(st.st_size) < FLASH_ROM_SIZE && ftruncate(fd, FLASH_ROM_SIZE) == -1)) {
+      perror("resize flash");
+      close(fd);
+      return false;
+    }
+    flags = MAP_SHARED;
+  }
+
+  void* p = mmap(NULL, FLASH_ROM_SIZE, PROT_READ | PROT_WRITE, flags | low_flag, fd, 0);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (p == MAP_FAILED) {
+    perror("mmap flash");
+    return false;
+  }
+
+  flash_rom = static_cast<uint8_t*>(p);
+  set_flash_file_backed(path != nullptr);
+  return true;
+}
+
+// The result cache key covers everything that determines the output of a cached (deterministic,
+// replayed) run.
+void
+compute_result_cache_key(const char* script, char key[SHA256_HEX_SIZE]) {
+  sha256_t ctx;
+  sha256_init(&ctx);
+
+  const char version[] = "microbit-result-cache-1";
+  sha256_update(&ctx, version, sizeof(version));
+  result_cache_hash_build_id(&ctx);
+  sha256_update(&ctx, script, strlen(script) + 1);
+  // The filesystem may have been preloaded (-P).
+  sha256_update(&ctx, flash_rom, FLASH_ROM_SIZE - MAX_SCRIPT_SIZE);
+
+  uint32_t options[] = {interactive, heartbeat_mode, push_updates, deterministic_seed,
+                        event_queue_depth, profile_interval};
+  sha256_update(&ctx, options, sizeof(options));
+
+  for (size_t i = 0; i < replay_records.size(); ++i) {
+    const trace_record_t& record = replay_records[i];
+    uint32_t header[] = {record.run, record.ticks, record.kind,
+                         static_cast<uint32_t>(record.payload.size())};
+    sha256_update(&ctx, header, sizeof(header));
+    sha256_update(&ctx, record.payload.data(), record.payload.size());
+  }
+
+  sha256_final_hex(&ctx, key);
+}
+
 uint32_t __data_start__ = 0;
 uint32_t __etext = 0;
 
@@ -1432,10 +3902,17 @@ main(int argc, char** argv) {
 
   // Load the program from the command line args, defaulting to microbit import
   // if nothing specified.
-  char script[MAX_SCRIPT_SIZE] = "from microbit import *\n";
+  std::string script = "from microbit import *\n";
   bool interactive_override = false;
   bool debug_mode = false;
   bool script_loaded = false;
+  const char* record_trace_path = nullptr;
+  const char* replay_trace_path = nullptr;
+  const char* result_cache_dir = nullptr;
+  const char* bytecode_cache_dir = nullptr;
+  const char* flash_path = nullptr;
+  const char* fs_import_path = nullptr;
+  const char* timeline_path = nullptr;
 
   for (int i = 1; i < argc; ++i) {
     if (strlen(argv[i]) > 0) {
@@ -1448,47 +3925,197 @@ main(int argc, char** argv) {
           fast_mode = true;
         } else if (argv[i][1] == 'd') {
           debug_mode = true;
+        } else if (argv[i][1] == 'l') {
+          lockstep_mode = true;
+        } else if (argv[i][1] == 'p') {
+          push_updates = false;
+        } else if (argv[i][1] == 'S') {
+          single_threaded = true;
+        } else if (argv[i][1] == 's' && i + 1 < argc) {
+          deterministic_mode = true;
+          deterministic_seed = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][1] == 'r' && i + 1 < argc) {
+          record_trace_path = argv[++i];
+        } else if (argv[i][1] == 'R' && i + 1 < argc) {
+          replay_trace_path = argv[++i];
+        } else if (argv[i][1] == 'C' && i + 1 < argc) {
+          result_cache_dir = argv[++i];
+        } else if (argv[i][1] == 'b' && i + 1 < argc) {
+          bytecode_cache_dir = argv[++i];
+        } else if (argv[i][1] == 'F' && i + 1 < argc) {
+          flash_path = argv[++i];
+        } else if (argv[i][1] == 'P' && i + 1 < argc) {
+          fs_import_path = argv[++i];
+        } else if (argv[i][1] == 'E' && i + 1 < argc) {
+          fs_export_dir = argv[++i];
+        } else if (argv[i][1] == 'c' && i + 1 < argc) {
+          perf_counters_enabled = true;
+          perf_stats_interval = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][1] == 'Q' && i + 1 < argc) {
+          event_queue_depth = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][1] == 'T' && i + 1 < argc) {
+          timeline_path = argv[++i];
+        } else if (argv[i][1] == 'y' && i + 1 < argc) {
+          profile_interval = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][1] == 'L') {
+          input_latency_enabled = true;
         }
       } else {
         script_loaded = true;
         int program_fd = open(argv[i], O_RDONLY);
         if (program_fd != -1) {
-          ssize_t len = read(program_fd, script, sizeof(script));
-          script[len] = 0;
+          // Read up to what fits in flash (after the appended script header).
+          script.clear();
+          char buf[4096];
+          ssize_t len;
+          while ((len = read(program_fd, buf, sizeof(buf))) > 0) {
+            script.append(buf, len);
+          }
+          script.resize(min(script.size(), MAX_SCRIPT_SIZE - sizeof(_appended_script_t) - 1));
         }
         close(program_fd);
       }
     }
   }
 
+  // Replaying a trace needs no client, and runs as fast as possible. Cached runs are always
+  // replays (of an empty trace if none is given), so that their output depends only on the key.
+  // A cache hit wouldn't reproduce the run's writes to a file-backed flash or export directory.
+  if ((flash_path || fs_export_dir) && result_cache_dir) {
+    fprintf(stderr, "Result cache disabled with file-backed flash or filesystem export.\n");
+    result_cache_dir = nullptr;
+  }
+
+  if (replay_trace_path || result_cache_dir) {
+    if (replay_trace_path && !load_trace(replay_trace_path)) {
+      return 1;
+    }
+    if (result_cache_dir) {
+      deterministic_mode = true;
+    }
+    replay_mode = true;
+    fast_mode = true;
+    lockstep_mode = false;
+    record_trace_path = nullptr;
+  }
+
+  // Lockstep is fast mode with time driven by the client, so it doesn't need heartbeats.
+  if (lockstep_mode) {
+    fast_mode = true;
+    heartbeat_mode = false;
+  }
+
+  // Deterministic mode needs VM progress to be tied to virtual time.
+  if (deterministic_mode) {
+    fast_mode = true;
+  }
+
+  // Input is only applied as it arrives outside deterministic and replay modes.
+  if (input_latency_enabled && (deterministic_mode || replay_mode)) {
+    fprintf(stderr, "Input latency not measured in deterministic or replay mode.\n");
+    input_latency_enabled = false;
+  }
+
+  if (timeline_path && !timeline_open(timeline_path)) {
+    return 1;
+  }
+
+  if (profile_interval && !profiler_start(profile_interval)) {
+    fprintf(stderr, "Python profiler not supported by this firmware.\n");
+    profile_interval = 0;
+  }
+
+  if (record_trace_path) {
+    trace_record_file = fopen(record_trace_path, "wb");
+    if (!trace_record_file) {
+      perror("open trace");
+      return 1;
+    }
+    trace_header_t header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.flags = deterministic_mode ? TRACE_FLAG_DETERMINISTIC : 0;
+    header.seed = deterministic_seed;
+    fwrite(&header, sizeof(header), 1, trace_record_file);
+    fflush(trace_record_file);
+  }
+
   // When a script is loaded, pay attention to the -i flag.
   if (script_loaded) {
     interactive = interactive_override;
   }
 
-  flash_rom = static_cast<uint8_t*>(malloc(FLASH_ROM_SIZE));
-  memset(flash_rom, 0, FLASH_ROM_SIZE);
+  if (event_queue_depth == 0) {
+    fprintf(stderr, "Event queue depth must be at least 1.\n");
+    return 1;
+  }
+  set_event_queue_depth(event_queue_depth);
+
+  if (!map_flash(flash_path)) {
+    return 1;
+  }
 
-  __etext = reinterpret_cast<uint32_t>(flash_rom);
+  __etext = flash_address(flash_rom);
 
-  // Create the "appended_script_t" struct that mprun.c expects.
+  // Create the "appended_script_t" struct that mprun.c expects. A file-backed flash may still hold
+  // an earlier script (and its compiled form), so the script area is cleared first. (An anonymous
+  // mapping is already zero, and clearing it would only make every page resident.)
+  if (flash_path) {
+    memset(flash_rom + FLASH_ROM_SIZE - MAX_SCRIPT_SIZE, 0, MAX_SCRIPT_SIZE);
+  }
   struct _appended_script_t* initial_script_struct =
       reinterpret_cast<_appended_script_t*>(flash_rom + FLASH_ROM_SIZE - MAX_SCRIPT_SIZE);
   initial_script_struct->header[0] = 'M';
   initial_script_struct->header[1] = 'P';
-  initial_script_struct->len = strlen(script);
-  strcpy(initial_script_struct->str, script);
+  initial_script_struct->len = strlen(script.c_str());
+  strcpy(initial_script_struct->str, script.c_str());
   initial_script = reinterpret_cast<char*>(initial_script_struct);
 
+  if (fs_import_path && !microbit_fs_import(fs_import_path)) {
+    return 1;
+  }
+
+  if (result_cache_dir) {
+    char key[SHA256_HEX_SIZE];
+    compute_result_cache_key(script.c_str(), key);
+
+    const char* max_bytes_str = getenv("GROK_RESULT_CACHE_MAX_BYTES");
+    uint64_t max_bytes = max_bytes_str ? strtoull(max_bytes_str, NULL, 0) : 256 * 1024 * 1024;
+    if (result_cache_init(result_cache_dir, max_bytes)) {
+      int updates = open_updates_fd();
+      int status = 0;
+      bool hit = result_cache_replay(key, updates, &status);
+      close(updates);
+      if (hit) {
+        unbuffered_terminal(false);
+        return status;
+      }
+      result_cache_begin(key);
+    }
+  }
+
+  if (bytecode_cache_dir) {
+    // Without the firmware's side, every run would miss and nothing would be stored.
+    if (!simulated_dal_micropy_compiled_script_support) {
+      fprintf(stderr, "Bytecode cache (-b) not supported by this firmware.\n");
+      return 1;
+    }
+    bytecode_cache_init(bytecode_cache_dir, script.c_str());
+  }
+
   int status = 0;
+  // Whether the last run exited by itself (rather than being killed), so its output is complete.
+  bool clean_exit = true;
 
   if (debug_mode) {
+    load_compiled_script();
     run_simulator();
   } else {
     // Micropython provides a 'reset()' method that restarts the simulation.
     // Easiest way to do that is to fork() the simulation and just start a new one when it
     // signals that it wants to restart.
     while (true) {
+      load_compiled_script();
       pid_t pid = fork();
       if (pid == -1) {
         // Error.
@@ -1503,14 +4130,22 @@ main(int argc, char** argv) {
         int wstatus = 0;
         waitpid(pid, &wstatus, 0);
         status = WEXITSTATUS(wstatus);
+        clean_exit = WIFEXITED(wstatus);
         if (status != SIMULATOR_RESET) {
           break;
         }
+        ++simulator_run;
       }
     }
   }
 
-  free(flash_rom);
+  munmap(flash_rom, FLASH_ROM_SIZE);
+
+  result_cache_end(clean_exit, status);
+
+  if (trace_record_file) {
+    fclose(trace_record_file);
+  }
 
   // Reset the terminal.
   unbuffered_terminal(false);
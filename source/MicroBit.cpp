@@ -349,7 +349,8 @@ MicroBit::sleep(int milliseconds) {
 }
 void
 MicroBit::seedRandom() {
-  seedRandom(static_cast<uint32_t>(time(NULL)));
+  // The simulator's PRNG is seeded at startup (from the clock, or the seed in deterministic mode).
+  seedRandom(get_entropy());
 }
 void
 MicroBit::seedRandom(uint32_t seed) {
@@ -728,21 +729,3 @@ MicroBitDisplay::disable() {
     set_disconnect_flag();
   }
 }
-
-// These aren't heavily used, and only for global lifetime objects, so forwarding them
-// to system malloc isn't going to affect the realism of the simulation in any noticable
-// way.
-int
-microbit_heap_init() {
-  return MICROBIT_OK;
-}
-
-void*
-microbit_malloc(size_t size) {
-  return malloc(size);
-}
-
-void
-microbit_free(void* p) {
-  return free(p);
-}
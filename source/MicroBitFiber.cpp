@@ -22,22 +22,388 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+/**
+  * Host implementation of the MicroBitFiber.h scheduler.
+  *
+  * Fibers run on their own (pooled) stacks and switch with ucontext. The main fiber is whatever
+  * context runs the VM (the code thread, or the VM context in single-threaded mode), so it can
+  * never be descheduled: when it sleeps or waits for an event, it runs other fibers and waits in
+  * __WFI() until it's woken. Every switch into a fiber returns to the context that resumed it when
+  * the fiber blocks, yields or finishes.
+  *
+  * All of this runs with code_lock held (scheduler_tick() is called by the ticker).
+  */
+
 #include "MicroBitFiber.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "ErrorNo.h"
 
 unsigned long ticks = 0;
+uint8_t fiber_flags = 0;
 Fiber mainFiber;
 Fiber* currentFiber = &mainFiber;
 
-int invoke(void (*entry_fn)(void *), void *param) {
-  fprintf(stderr, "Unhandled: invoke()\n");
+namespace {
+const size_t FIBER_STACK_SIZE = 256 * 1024;
+// Finished fibers (and their stacks) are kept for reuse, up to this many.
+const int FIBER_POOL_SIZE = 8;
+
+// Wildcards for fiber_wait_for_event (MICROBIT_ID_ANY and MICROBIT_EVT_ANY).
+const uint16_t EVENT_ANY = 0;
+
+struct HostFiber {
+  // Must be first, so that a Fiber* can be converted back to its HostFiber.
+  Fiber fiber;
+  ucontext_t context;
+  // Where to switch to when this fiber blocks, yields or finishes.
+  ucontext_t* resumer;
+  void* stack;
+  bool finished;
+
+  // Either entry/completion or entry_param/completion_param (with param) is set.
+  void (*entry)(void);
+  void (*completion)(void);
+  void (*entry_param)(void*);
+  void (*completion_param)(void*);
+  void* param;
+};
+
+ucontext_t main_context;
+
+Fiber* runQueue = NULL;
+Fiber* sleepQueue = NULL;
+Fiber* waitQueue = NULL;
+
+HostFiber* fiber_pool[FIBER_POOL_SIZE];
+int fiber_pool_size = 0;
+
+HostFiber*
+host_fiber(Fiber* f) {
+  return reinterpret_cast<HostFiber*>(f);
+}
+
+ucontext_t*
+context_of(Fiber* f) {
+  return f == &mainFiber ? &main_context : &host_fiber(f)->context;
+}
+
+void
+fiber_entry() {
+  HostFiber* f = host_fiber(currentFiber);
+  if (f->entry_param) {
+    f->entry_param(f->param);
+    f->completion_param(f->param);
+  } else {
+    f->entry();
+    f->completion();
+  }
+  // The completion function normally doesn't return (release_fiber).
+  release_fiber();
+}
+
+HostFiber*
+get_fiber() {
+  HostFiber* f;
+  if (fiber_pool_size > 0) {
+    f = fiber_pool[--fiber_pool_size];
+  } else {
+    f = new HostFiber();
+    f->stack = malloc(FIBER_STACK_SIZE);
+    if (!f->stack) {
+      delete f;
+      return NULL;
+    }
+  }
+
+  getcontext(&f->context);
+  f->context.uc_stack.ss_sp = f->stack;
+  f->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+  f->context.uc_link = NULL;
+  makecontext(&f->context, &fiber_entry, 0);
+
+  f->fiber.context = 0;
+  f->fiber.flags = 0;
+  f->fiber.queue = NULL;
+  f->fiber.next = f->fiber.prev = NULL;
+  f->resumer = NULL;
+  f->finished = false;
+  f->entry = f->completion = NULL;
+  f->entry_param = f->completion_param = NULL;
+  f->param = NULL;
+  return f;
+}
+
+void
+recycle_fiber(HostFiber* f) {
+  if (fiber_pool_size < FIBER_POOL_SIZE) {
+    fiber_pool[fiber_pool_size++] = f;
+  } else {
+    free(f->stack);
+    delete f;
+  }
+}
+
+// Run f until it blocks, yields or finishes.
+void
+switch_to(HostFiber* f) {
+  Fiber* previous = currentFiber;
+  f->resumer = context_of(previous);
+  currentFiber = &f->fiber;
+  swapcontext(f->resumer, &f->context);
+  currentFiber = previous;
+
+  if (f->finished) {
+    recycle_fiber(f);
+  }
+}
+
+// Switch the current (non-main) fiber back to whoever resumed it. Returns when it's next resumed.
+void
+block_current() {
+  HostFiber* f = host_fiber(currentFiber);
+  swapcontext(&f->context, f->resumer);
+}
+
+// Move a fiber that was sleeping or waiting back to the run queue. The main fiber is never on the
+// run queue, it just stops waiting.
+void
+wake_fiber(Fiber* f) {
+  dequeue_fiber(f);
+  if (f != &mainFiber) {
+    queue_fiber(f, &runQueue);
+  }
+}
+
+// Run each fiber that is currently runnable once, oldest first. The run queue is detached first,
+// so fibers that yield (or are created) while this runs go back on it for the next call.
+void
+run_runnable_fibers() {
+  Fiber* batch = runQueue;
+  if (!batch) {
+    return;
+  }
+  runQueue = NULL;
+  Fiber* f = batch;
+  f->queue = &batch;
+  while (f->next) {
+    f = f->next;
+    f->queue = &batch;
+  }
+  // Walk from the tail (oldest) to the head, remembering where to go next before running each.
+  while (f) {
+    Fiber* prev = f->prev;
+    dequeue_fiber(f);
+    switch_to(host_fiber(f));
+    f = prev;
+  }
+}
+
+// The main fiber waits (running other fibers) until it's taken off the sleep/wait queue.
+void
+wait_main_fiber() {
+  while (mainFiber.queue) {
+    run_runnable_fibers();
+    if (!mainFiber.queue) {
+      break;
+    }
+    idle();
+  }
+}
+}
+
+void
+scheduler_init() {
+  currentFiber = &mainFiber;
+}
+
+void
+release_fiber(void) {
+  if (currentFiber == &mainFiber) {
+    return;
+  }
+  HostFiber* f = host_fiber(currentFiber);
+  f->finished = true;
+  setcontext(f->resumer);
+}
+
+void
+release_fiber(void*) {
+  release_fiber();
+}
+
+Fiber*
+create_fiber(void (*entry_fn)(void), void (*completion_fn)(void)) {
+  if (!entry_fn) {
+    return NULL;
+  }
+  HostFiber* f = get_fiber();
+  if (!f) {
+    return NULL;
+  }
+  f->entry = entry_fn;
+  f->completion = completion_fn;
+  queue_fiber(&f->fiber, &runQueue);
+  return &f->fiber;
+}
+
+Fiber*
+create_fiber(void (*entry_fn)(void*), void* param, void (*completion_fn)(void*)) {
+  if (!entry_fn) {
+    return NULL;
+  }
+  HostFiber* f = get_fiber();
+  if (!f) {
+    return NULL;
+  }
+  f->entry_param = entry_fn;
+  f->completion_param = completion_fn;
+  f->param = param;
+  queue_fiber(&f->fiber, &runQueue);
+  return &f->fiber;
+}
+
+void
+schedule() {
+  if (currentFiber == &mainFiber) {
+    run_runnable_fibers();
+    return;
+  }
+
+  // Yield (unless the fiber is already going onto the sleep or wait queue).
+  if (!currentFiber->queue) {
+    queue_fiber(currentFiber, &runQueue);
+  }
+  block_current();
+}
+
+void
+fiber_sleep(unsigned long t) {
+  currentFiber->context = ticks + t;
+  queue_fiber(currentFiber, &sleepQueue);
+  if (currentFiber == &mainFiber) {
+    wait_main_fiber();
+  } else {
+    block_current();
+  }
+}
+
+void
+scheduler_tick() {
+  Fiber* f = sleepQueue;
+  while (f) {
+    Fiber* next = f->next;
+    if (ticks >= f->context) {
+      wake_fiber(f);
+    }
+    f = next;
+  }
+}
+
+void
+fiber_wait_for_event(uint16_t id, uint16_t value) {
+  currentFiber->context = ((uint32_t)value << 16) | id;
+  queue_fiber(currentFiber, &waitQueue);
+  if (currentFiber == &mainFiber) {
+    wait_main_fiber();
+  } else {
+    block_current();
+  }
+}
+
+void
+scheduler_event(MicroBitEvent evt) {
+  Fiber* f = waitQueue;
+  while (f) {
+    Fiber* next = f->next;
+    uint16_t id = f->context & 0xffff;
+    uint16_t value = f->context >> 16;
+    if ((id == evt.source || id == EVENT_ANY) && (value == evt.value || value == EVENT_ANY)) {
+      wake_fiber(f);
+    }
+    f = next;
+  }
+}
+
+// There is no stack to snapshot on the host, so the function always starts on a fiber of its own
+// (from the pool, so this is cheap). If it finishes without blocking, the fiber is recycled
+// straight away. If it blocks, the caller carries on and the fiber is scheduled later.
+int
+invoke(void (*entry_fn)(void)) {
+  if (!entry_fn) {
+    return MICROBIT_INVALID_PARAMETER;
+  }
+  HostFiber* f = get_fiber();
+  if (!f) {
+    return MICROBIT_NO_RESOURCES;
+  }
+  f->entry = entry_fn;
+  f->completion = release_fiber;
+  switch_to(f);
+  return MICROBIT_OK;
+}
+
+int
+invoke(void (*entry_fn)(void*), void* param) {
+  if (!entry_fn) {
+    return MICROBIT_INVALID_PARAMETER;
+  }
+  HostFiber* f = get_fiber();
+  if (!f) {
+    return MICROBIT_NO_RESOURCES;
+  }
+  f->entry_param = entry_fn;
+  f->completion_param = release_fiber;
+  f->param = param;
+  switch_to(f);
+  return MICROBIT_OK;
+}
+
+int
+scheduler_runqueue_empty() {
+  return runQueue == NULL;
+}
+
+void
+queue_fiber(Fiber* f, Fiber** queue) {
+  f->queue = queue;
+  f->prev = NULL;
+  f->next = *queue;
+  if (*queue) {
+    (*queue)->prev = f;
+  }
+  *queue = f;
+}
+
+void
+dequeue_fiber(Fiber* f) {
+  if (!f->queue) {
+    return;
+  }
+  if (f->prev) {
+    f->prev->next = f->next;
+  } else {
+    *f->queue = f->next;
+  }
+  if (f->next) {
+    f->next->prev = f->prev;
+  }
+  f->next = f->prev = NULL;
+  f->queue = NULL;
 }
 
-void schedule() {
-  fprintf(stderr, "Unhandled: schedule()\n");
+void
+idle() {
+  __WFI();
 }
 
-int scheduler_runqueue_empty() {
-  fprintf(stderr, "Unhandled: scheduler_runqueue_empty()\n");
+void
+idle_task() {
+  while (true) {
+    idle();
+    schedule();
+  }
 }
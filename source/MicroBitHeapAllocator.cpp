@@ -0,0 +1,278 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Emulation of the nRF51 heap used by the DAL (microbit-dal's MicroBitHeapAllocator.cpp).
+//
+// The device heap is made up of the SRAM normally reserved for the SoftDevice (BLE is never
+// enabled in the simulator) and a share (MICROBIT_HEAP_SIZE) of the free mbed heap. Each is
+// managed as an array of MICROBIT_HEAP_BLOCK_SIZE blocks, where every allocation is rounded up to
+// whole blocks plus a header block holding its length, with first fit allocation and free blocks
+// merged while searching -- the same algorithm as the DAL. Like the DAL, allocations fall back to
+// the native heap when both are full, and only fail (panicking with MICROBIT_OOM if
+// MICROBIT_PANIC_HEAP_FULL is enabled) when that's full too.
+//
+// Only the block headers are emulated. The memory handed out is allocated from the host (with a
+// small header recording which device block it corresponds to), since host objects aren't
+// necessarily laid out like their ARM counterparts.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ErrorNo.h"
+#include "Hardware.h"
+#include "MicroBitConfig.h"
+#include "MicroBitHeapAllocator.h"
+
+namespace {
+const uint32_t MICROBIT_HEAP_BLOCK_FREE = 0x80000000;
+
+// The DAL measures the free mbed heap at startup. On the device, this is everything between the
+// SoftDevice's reserved SRAM and the stack that microbit-micropython's static data doesn't use, so
+// estimate it as that whole range.
+const uint32_t MBED_HEAP_FREE = MICROBIT_HEAP_END - MICROBIT_HEAP_SD_LIMIT;
+
+const uint32_t SD_HEAP_BLOCKS =
+    (MICROBIT_HEAP_SD_LIMIT - MICROBIT_HEAP_BASE_BLE_DISABLED) / MICROBIT_HEAP_BLOCK_SIZE;
+const uint32_t NESTED_HEAP_BLOCKS =
+    (uint32_t)(MBED_HEAP_FREE * MICROBIT_HEAP_SIZE) / MICROBIT_HEAP_BLOCK_SIZE;
+
+// When both heaps are full, the DAL falls back to the native (newlib) malloc, which has the rest of
+// the mbed heap. Only its capacity is modelled: each allocation uses its size plus newlib's chunk
+// header, rounded to 8 bytes (fragmentation of the native heap isn't modelled).
+const uint32_t NATIVE_HEAP_FREE = MBED_HEAP_FREE - NESTED_HEAP_BLOCKS * MICROBIT_HEAP_BLOCK_SIZE;
+
+uint32_t
+native_chunk_size(size_t size) {
+  return (size + 8 + 7) & ~7;
+}
+
+struct heap_definition_t {
+  uint32_t* heap_start;
+  uint32_t* heap_end;
+};
+
+// Block headers for both heaps. Each heap is followed by a used (zero) sentinel, so the merge in
+// heap_alloc can read the block after the end of the heap.
+uint32_t heap_blocks[SD_HEAP_BLOCKS + 1 + NESTED_HEAP_BLOCKS + 1];
+heap_definition_t heaps[2];
+bool heap_initialised = false;
+
+// Prefixed to each host allocation.
+union host_block_t {
+  struct {
+    // NULL for allocations from the native heap.
+    uint32_t* block;
+    uint32_t size;
+  } header;
+  // Keep the caller's memory aligned like malloc's.
+  long double align;
+};
+
+heap_stats_t stats;
+
+void
+create_heap(heap_definition_t* heap, uint32_t* start, uint32_t blocks) {
+  heap->heap_start = start;
+  heap->heap_end = start + blocks;
+  *heap->heap_start = blocks | MICROBIT_HEAP_BLOCK_FREE;
+  *heap->heap_end = 0;
+}
+
+// First fit allocation of size bytes (plus a header block) from the given heap, merging adjacent
+// free blocks as they're found. Returns the header block, or NULL if the heap is full.
+uint32_t*
+heap_alloc(size_t size, heap_definition_t* heap) {
+  uint32_t blockSize = 0;
+  uint32_t blocksNeeded = (size + MICROBIT_HEAP_BLOCK_SIZE - 1) / MICROBIT_HEAP_BLOCK_SIZE + 1;
+  uint32_t* block = heap->heap_start;
+  uint32_t* next;
+
+  while (block < heap->heap_end) {
+    // If the block is used, then keep looking.
+    if (!(*block & MICROBIT_HEAP_BLOCK_FREE)) {
+      block += *block;
+      continue;
+    }
+
+    blockSize = *block & ~MICROBIT_HEAP_BLOCK_FREE;
+
+    // We have a free block. Let's see if the subsequent ones are too. If so, we can merge...
+    next = block + blockSize;
+    while (next < heap->heap_end && (*next & MICROBIT_HEAP_BLOCK_FREE)) {
+      blockSize += *next & ~MICROBIT_HEAP_BLOCK_FREE;
+      *block = blockSize | MICROBIT_HEAP_BLOCK_FREE;
+      next = block + blockSize;
+    }
+
+    if (blockSize >= blocksNeeded) {
+      break;
+    }
+
+    block += blockSize;
+  }
+
+  if (block >= heap->heap_end) {
+    return NULL;
+  }
+
+  // If we're at the end of memory or have very near match then mark the whole segment as in use.
+  if (blockSize <= blocksNeeded + 1 || block + blocksNeeded + 1 >= heap->heap_end) {
+    *block &= ~MICROBIT_HEAP_BLOCK_FREE;
+  } else {
+    // Split the block.
+    uint32_t* splitBlock = block + blocksNeeded;
+    *splitBlock = (blockSize - blocksNeeded) | MICROBIT_HEAP_BLOCK_FREE;
+    *block = blocksNeeded;
+  }
+
+  return block;
+}
+
+void
+ensure_heap_initialised() {
+  if (!heap_initialised) {
+    microbit_heap_init();
+  }
+}
+}
+
+int
+microbit_heap_init() {
+  create_heap(&heaps[0], heap_blocks, SD_HEAP_BLOCKS);
+  create_heap(&heaps[1], heap_blocks + SD_HEAP_BLOCKS + 1, NESTED_HEAP_BLOCKS);
+  heap_initialised = true;
+
+  stats = heap_stats_t();
+  stats.size = (SD_HEAP_BLOCKS + NESTED_HEAP_BLOCKS) * MICROBIT_HEAP_BLOCK_SIZE;
+  stats.native_size = NATIVE_HEAP_FREE;
+  return MICROBIT_OK;
+}
+
+void*
+microbit_malloc(size_t size) {
+  ensure_heap_initialised();
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  uint32_t* block = NULL;
+  for (int i = 0; i < 2 && !block; ++i) {
+    block = heap_alloc(size, &heaps[i]);
+  }
+
+  bool native = false;
+  if (!block) {
+    // Fall back to the native heap, like the DAL.
+    native = stats.native_used_bytes + native_chunk_size(size) <= NATIVE_HEAP_FREE;
+  }
+
+  if (!block && !native) {
+    // The device would be out of memory.
+    stats.failures++;
+#if CONFIG_ENABLED(MICROBIT_PANIC_HEAP_FULL)
+    // The DAL panics, never returning.
+    fprintf(stderr, "micro:bit panic: %d (out of memory allocating %zu bytes)\n", MICROBIT_OOM,
+            size);
+    set_panic_flag();
+    halt_on_panic();
+#endif
+    return NULL;
+  }
+
+  host_block_t* host = static_cast<host_block_t*>(malloc(sizeof(host_block_t) + size));
+  if (!host) {
+    if (block) {
+      *block |= MICROBIT_HEAP_BLOCK_FREE;
+    }
+    return NULL;
+  }
+  host->header.block = block;
+  host->header.size = size;
+
+  stats.allocations++;
+  stats.live_bytes += size;
+  if (block) {
+    stats.used_bytes += *block * MICROBIT_HEAP_BLOCK_SIZE;
+    if (stats.used_bytes > stats.peak_used_bytes) {
+      stats.peak_used_bytes = stats.used_bytes;
+    }
+  } else {
+    stats.native_used_bytes += native_chunk_size(size);
+    if (stats.native_used_bytes > stats.peak_native_used_bytes) {
+      stats.peak_native_used_bytes = stats.native_used_bytes;
+    }
+  }
+
+  return host + 1;
+}
+
+void
+microbit_free(void* p) {
+  if (p == NULL) {
+    return;
+  }
+
+  host_block_t* host = static_cast<host_block_t*>(p) - 1;
+  uint32_t* block = host->header.block;
+
+  stats.live_bytes -= host->header.size;
+  if (block) {
+    stats.used_bytes -= *block * MICROBIT_HEAP_BLOCK_SIZE;
+    *block |= MICROBIT_HEAP_BLOCK_FREE;
+  } else {
+    stats.native_used_bytes -= native_chunk_size(host->header.size);
+  }
+
+  free(host);
+}
+
+heap_stats_t
+get_heap_stats() {
+  ensure_heap_initialised();
+
+  // Free space is only merged lazily, so merge runs of free blocks here to find the largest
+  // allocation that could succeed.
+  heap_stats_t result = stats;
+  for (int i = 0; i < 2; ++i) {
+    uint32_t* block = heaps[i].heap_start;
+    while (block < heaps[i].heap_end) {
+      uint32_t blocks = *block & ~MICROBIT_HEAP_BLOCK_FREE;
+      if (*block & MICROBIT_HEAP_BLOCK_FREE) {
+        uint32_t* next = block + blocks;
+        while (next < heaps[i].heap_end && (*next & MICROBIT_HEAP_BLOCK_FREE)) {
+          blocks += *next & ~MICROBIT_HEAP_BLOCK_FREE;
+          next = block + blocks;
+        }
+        // Less the header block.
+        uint32_t bytes = (blocks - 1) * MICROBIT_HEAP_BLOCK_SIZE;
+        if (bytes > result.largest_free_bytes) {
+          result.largest_free_bytes = bytes;
+        }
+      }
+      block += blocks;
+    }
+  }
+  return result;
+}
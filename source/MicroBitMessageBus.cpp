@@ -30,6 +30,137 @@ SOFTWARE.
 
 #include "MicroBit.h"
 
+#include <map>
+#include <vector>
+
+#include "Hardware.h"
+
+namespace {
+// Event queue items, for both the bus's queue and listeners' queues, come from a pool. Released
+// items are kept for reuse, so once the pool has grown to the most events ever queued at once,
+// queueing an event doesn't allocate.
+MicroBitEventQueueItem* free_queue_items = NULL;
+
+// Limits the length of the bus's queue and of each listener's queue.
+uint32_t event_queue_depth = MESSAGE_BUS_LISTENER_MAX_QUEUE_DEPTH;
+event_queue_stats_t event_queue_stats;
+
+MicroBitEventQueueItem*
+alloc_queue_item(MicroBitEvent& evt) {
+  MicroBitEventQueueItem* item = free_queue_items;
+  if (item == NULL)
+    return new MicroBitEventQueueItem(evt);
+
+  free_queue_items = item->next;
+  item->evt = evt;
+  item->next = NULL;
+  return item;
+}
+
+void
+free_queue_item(MicroBitEventQueueItem* item) {
+  item->next = free_queue_items;
+  free_queue_items = item;
+}
+
+// Make sure the pool has at least n free items.
+void
+reserve_queue_items(uint32_t n) {
+  uint32_t free_items = 0;
+  for (MicroBitEventQueueItem* item = free_queue_items; item; item = item->next)
+    free_items++;
+
+  MicroBitEvent evt(0, 0, CREATE_ONLY);
+  for (; free_items < n; ++free_items)
+    free_queue_item(new MicroBitEventQueueItem(evt));
+}
+
+// Add an event to the tail of a busy listener's queue (as MicroBitListener::queue does, but with
+// pooled items and the configured depth).
+void
+queue_listener_event(MicroBitListener* listener, MicroBitEvent& evt) {
+  MicroBitEventQueueItem** tail = &listener->evt_queue;
+  uint32_t depth = 0;
+
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+    depth++;
+  }
+
+  if (depth >= event_queue_depth) {
+    event_queue_stats.listener_dropped++;
+    return;
+  }
+
+  *tail = alloc_queue_item(evt);
+}
+
+// Dispatch index for the listeners list.
+//
+// The listeners list is kept sorted by (id, value), and stays the authoritative order (and is
+// what deleteMarkedListeners() and elementAt() walk). Alongside it, each bus keeps a bucket per
+// (id, value) pair, holding that pair's listeners in list order, split into urgent and standard
+// listeners. MICROBIT_ID_ANY and MICROBIT_EVT_ANY are 0, so the wildcard listeners simply live in
+// the (ANY, ANY), (ANY, value) and (id, ANY) buckets, and visiting an event's (up to four) buckets
+// in key order gives exactly the order of a walk of the full list.
+struct ListenerBucket {
+  std::vector<MicroBitListener*> all;
+  std::vector<MicroBitListener*> urgent;
+  std::vector<MicroBitListener*> standard;
+};
+
+typedef std::map<uint32_t, ListenerBucket> ListenerIndex;
+
+// Listeners matched by a single event are copied out before any are called (handlers may
+// add listeners). Most events match only a few.
+const int MAX_INLINE_MATCHES = 16;
+
+uint32_t
+listener_key(int id, int value) {
+  return ((uint32_t)(id & 0xffff) << 16) | (value & 0xffff);
+}
+
+bool
+is_urgent(MicroBitListener* l) {
+  return (l->flags & MESSAGE_BUS_LISTENER_IMMEDIATE) == MESSAGE_BUS_LISTENER_IMMEDIATE;
+}
+
+// Indexes for each bus. Function-local so that it's usable from other static constructors.
+std::map<const MicroBitMessageBus*, ListenerIndex>&
+listener_indexes() {
+  static std::map<const MicroBitMessageBus*, ListenerIndex>* indexes =
+      new std::map<const MicroBitMessageBus*, ListenerIndex>();
+  return *indexes;
+}
+
+ListenerIndex&
+listener_index(const MicroBitMessageBus* bus) {
+  return listener_indexes()[bus];
+}
+
+void
+erase_listener(std::vector<MicroBitListener*>* v, MicroBitListener* l) {
+  for (std::vector<MicroBitListener*>::iterator it = v->begin(); it != v->end(); ++it) {
+    if (*it == l) {
+      v->erase(it);
+      return;
+    }
+  }
+}
+
+void
+unindex_listener(ListenerIndex* index, MicroBitListener* l) {
+  ListenerIndex::iterator it = index->find(listener_key(l->id, l->value));
+  if (it == index->end())
+    return;
+
+  erase_listener(&it->second.all, l);
+  erase_listener(is_urgent(l) ? &it->second.urgent : &it->second.standard, l);
+  if (it->second.all.empty())
+    index->erase(it);
+}
+}
+
 /**
   * Constructor.
   * Create a new Message Bus.
@@ -39,6 +170,19 @@ MicroBitMessageBus::MicroBitMessageBus() {
   this->evt_queue_head = NULL;
   this->evt_queue_tail = NULL;
   this->queueLength = 0;
+
+  reserve_queue_items(event_queue_depth);
+}
+
+void
+set_event_queue_depth(uint32_t depth) {
+  event_queue_depth = depth;
+  reserve_queue_items(depth);
+}
+
+event_queue_stats_t
+get_event_queue_stats() {
+  return event_queue_stats;
 }
 
 /**
@@ -58,12 +202,14 @@ async_callback(void* param) {
 
   if (listener->flags & MESSAGE_BUS_LISTENER_BUSY) {
     // Drop this event, if that's how we've been configured.
-    if (listener->flags & MESSAGE_BUS_LISTENER_DROP_IF_BUSY)
+    if (listener->flags & MESSAGE_BUS_LISTENER_DROP_IF_BUSY) {
+      event_queue_stats.busy_dropped++;
       return;
+    }
 
     // Queue this event up for later, if that's how we've been configured.
     if (listener->flags & MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY) {
-      listener->queue(listener->evt);
+      queue_listener_event(listener, listener->evt);
       return;
     }
   }
@@ -93,7 +239,7 @@ async_callback(void* param) {
 
       listener->evt = item->evt;
       listener->evt_queue = listener->evt_queue->next;
-      delete item;
+      free_queue_item(item);
 
       // We spin the scheduler here, to preven any particular event handler from continuously
       // holding onto resources.
@@ -128,14 +274,16 @@ MicroBitMessageBus::queueEvent(MicroBitEvent& evt) {
     return;
 
   // If we need to queue, but there is no space, then there's nothg we can do.
-  if (queueLength >= MESSAGE_BUS_LISTENER_MAX_QUEUE_DEPTH)
+  if (queueLength >= (int)event_queue_depth) {
+    event_queue_stats.dropped++;
     return;
+  }
 
   // Otherwise, we need to queue this event for later processing...
   // We queue this event at the tail of the queue at the point where we entered queueEvent()
   // This is important as the processing above *may* have generated further events, and
   // we want to maintain ordering of events.
-  MicroBitEventQueueItem* item = new MicroBitEventQueueItem(evt);
+  MicroBitEventQueueItem* item = alloc_queue_item(evt);
 
   // The queue was empty when we entered this function, so queue our event at the start of the
   // queue.
@@ -153,6 +301,8 @@ MicroBitMessageBus::queueEvent(MicroBitEvent& evt) {
     evt_queue_tail = item;
 
   queueLength++;
+  if ((uint32_t)queueLength > event_queue_stats.high_water)
+    event_queue_stats.high_water = queueLength;
 
   __enable_irq();
 }
@@ -208,6 +358,12 @@ MicroBitMessageBus::deleteMarkedListeners() {
       MicroBitListener* t = l;
       l = l->next;
 
+      unindex_listener(&listener_index(this), t);
+      while (t->evt_queue != NULL) {
+        MicroBitEventQueueItem* item = t->evt_queue;
+        t->evt_queue = item->next;
+        free_queue_item(item);
+      }
       delete t;
       removed++;
 
@@ -240,7 +396,7 @@ MicroBitMessageBus::idleTick() {
     this->process(item->evt);
 
     // Free the queue item.
-    delete item;
+    free_queue_item(item);
 
     // If we have created some useful work to do, we stop processing.
     // This helps to minimise the number of blocked fibers we create at any point in time, therefore
@@ -301,38 +457,82 @@ MicroBitMessageBus::send(MicroBitEvent evt) {
  */
 int
 MicroBitMessageBus::process(MicroBitEvent& evt, bool urgent) {
-  MicroBitListener* l;
+  ListenerIndex& index = listener_index(this);
   int complete = 1;
-  bool listenerUrgent;
 
-  l = listeners;
-  while (l != NULL) {
-    if ((l->id == evt.source || l->id == MICROBIT_ID_ANY) &&
-        (l->value == evt.value || l->value == MICROBIT_EVT_ANY)) {
-      listenerUrgent =
-          (l->flags & MESSAGE_BUS_LISTENER_IMMEDIATE) == MESSAGE_BUS_LISTENER_IMMEDIATE;
-      if (listenerUrgent == urgent && !(l->flags & MESSAGE_BUS_LISTENER_DELETING)) {
-        l->evt = evt;
-
-        // OK, if this handler has regisitered itself as non-blocking, we just execute it
-        // directly...
-        // This is normally only done for trusted system components.
-        // Otherwise, we invoke it in a 'fork on block' context, that will automatically create a
-        // fiber
-        // should the event handler attempt a blocking operation, but doesn't have the overhead
-        // of creating a fiber needlessly. (cool huh?)
-        if (l->flags & MESSAGE_BUS_LISTENER_NONBLOCKING)
-          async_callback(l);
-        else
-          invoke(async_callback, l);
-      } else {
-        complete = 0;
-      }
+  // The buckets this event can match, in list order (see ListenerIndex).
+  uint32_t keys[4] = {
+      listener_key(MICROBIT_ID_ANY, MICROBIT_EVT_ANY), listener_key(MICROBIT_ID_ANY, evt.value),
+      listener_key(evt.source, MICROBIT_EVT_ANY), listener_key(evt.source, evt.value),
+  };
+  ListenerBucket* buckets[4];
+  int num_buckets = 0;
+  size_t num_matches = 0;
+
+  for (int i = 0; i < 4; ++i) {
+    // If the source or value is ANY, some of the keys are repeated.
+    if ((i == 1 && keys[1] == keys[0]) || (i == 2 && keys[2] == keys[0]) ||
+        (i == 3 && (keys[3] == keys[1] || keys[3] == keys[2])))
+      continue;
+
+    ListenerIndex::iterator it = index.find(keys[i]);
+    if (it == index.end())
+      continue;
+
+    // Listeners of the other type still need processing.
+    if (!(urgent ? it->second.standard : it->second.urgent).empty())
+      complete = 0;
+
+    buckets[num_buckets++] = &it->second;
+    num_matches += (urgent ? it->second.urgent : it->second.standard).size();
+  }
+
+  if (num_matches == 0)
+    return complete;
+
+  // Take a copy of the matching listeners, as the handlers may add more.
+  MicroBitListener* inline_matches[MAX_INLINE_MATCHES];
+  std::vector<MicroBitListener*> heap_matches;
+  MicroBitListener** matches = inline_matches;
+  if (num_matches > MAX_INLINE_MATCHES) {
+    heap_matches.resize(num_matches);
+    matches = &heap_matches[0];
+  }
+
+  size_t n = 0;
+  for (int i = 0; i < num_buckets; ++i) {
+    std::vector<MicroBitListener*>& v = urgent ? buckets[i]->urgent : buckets[i]->standard;
+    for (size_t j = 0; j < v.size(); ++j)
+      matches[n++] = v[j];
+  }
+
+  for (size_t i = 0; i < num_matches; ++i) {
+    MicroBitListener* l = matches[i];
+
+    if (l->flags & MESSAGE_BUS_LISTENER_DELETING) {
+      complete = 0;
+      continue;
     }
 
-    l = l->next;
+    l->evt = evt;
+
+    // OK, if this handler has regisitered itself as non-blocking, we just execute it
+    // directly...
+    // This is normally only done for trusted system components.
+    // Otherwise, we invoke it in a 'fork on block' context, that will automatically create a
+    // fiber
+    // should the event handler attempt a blocking operation, but doesn't have the overhead
+    // of creating a fiber needlessly. (cool huh?)
+    if (l->flags & MESSAGE_BUS_LISTENER_NONBLOCKING)
+      async_callback(l);
+    else
+      invoke(async_callback, l);
   }
 
+  // Unblock any fibers that may be waiting for this event.
+  if (!urgent)
+    scheduler_event(evt);
+
   return complete;
 }
 
@@ -459,14 +659,16 @@ MicroBitMessageBus::ignore(int id, int value, void (*handler)(MicroBitEvent, voi
   */
 int
 MicroBitMessageBus::add(MicroBitListener* newListener) {
-  MicroBitListener *l, *p;
+  MicroBitListener* l;
   int methodCallback;
 
   // handler can't be NULL!
   if (newListener == NULL)
     return MICROBIT_INVALID_PARAMETER;
 
-  l = listeners;
+  ListenerIndex& index = listener_index(this);
+  uint32_t key = listener_key(newListener->id, newListener->value);
+  ListenerIndex::iterator bucket = index.find(key);
 
   // Firstly, we treat a listener as an idempotent operation. Ensure we don't already have this
   // handler
@@ -475,67 +677,58 @@ MicroBitMessageBus::add(MicroBitListener* newListener) {
   // We always check the ID, VALUE and CB_METHOD fields.
   // If we have a callback to a method, check the cb_method class. Otherwise, the cb function point
   // is sufficient.
-  while (l != NULL) {
-    methodCallback = (newListener->flags & MESSAGE_BUS_LISTENER_METHOD) &&
-                     (l->flags & MESSAGE_BUS_LISTENER_METHOD);
-
-    if (l->id == newListener->id && l->value == newListener->value &&
-        (methodCallback ? *l->cb_method == *newListener->cb_method : l->cb == newListener->cb)) {
-      // We have a perfect match for this event listener already registered.
-      // If it's marked for deletion, we simply resurrect the listener, and we're done.
-      // Either way, we return an error code, as the *new* listener should be released...
-      if (l->flags & MESSAGE_BUS_LISTENER_DELETING)
-        l->flags &= ~MESSAGE_BUS_LISTENER_DELETING;
-
-      return MICROBIT_NOT_SUPPORTED;
+  // Any such listener must be in the bucket for this ID and VALUE.
+  if (bucket != index.end()) {
+    for (size_t i = 0; i < bucket->second.all.size(); ++i) {
+      l = bucket->second.all[i];
+      methodCallback = (newListener->flags & MESSAGE_BUS_LISTENER_METHOD) &&
+                       (l->flags & MESSAGE_BUS_LISTENER_METHOD);
+
+      if (methodCallback ? *l->cb_method == *newListener->cb_method : l->cb == newListener->cb) {
+        // We have a perfect match for this event listener already registered.
+        // If it's marked for deletion, we simply resurrect the listener, and we're done.
+        // Either way, we return an error code, as the *new* listener should be released...
+        if (l->flags & MESSAGE_BUS_LISTENER_DELETING)
+          l->flags &= ~MESSAGE_BUS_LISTENER_DELETING;
+
+        return MICROBIT_NOT_SUPPORTED;
+      }
     }
-
-    l = l->next;
   }
 
   // We have a valid, new event handler. Add it to the list.
-  // if listeners is null - we can automatically add this listener to the list at the beginning...
-  if (listeners == NULL) {
-    listeners = newListener;
-    MicroBitEvent(MICROBIT_ID_MESSAGE_BUS_LISTENER, newListener->id);
-
-    return MICROBIT_OK;
-  }
-
   // We maintain an ordered list of listeners.
   // The chain is held stictly in increasing order of ID (first level), then value code (second
-  // level).
-  // Find the correct point in the chain for this event.
-  // Adding a listener is a rare occurance, so we just walk the list...
-
-  p = listeners;
-  l = listeners;
-
-  while (l != NULL && l->id < newListener->id) {
-    p = l;
-    l = l->next;
-  }
-
-  while (l != NULL && l->id == newListener->id && l->value < newListener->value) {
-    p = l;
-    l = l->next;
-  }
-
-  // add at front of list
-  if (p == listeners &&
-      (newListener->id < p->id || (p->id == newListener->id && p->value > newListener->value))) {
-    newListener->next = p;
-
-    // this new listener is now the front!
-    listeners = newListener;
-  }
-
-  // add after p
-  else {
+  // level). A new listener goes after the last listener with a lower ID/value, i.e. ahead of any
+  // with the same ID and value -- unless there are none lower, in which case it goes at the front
+  // of the list, or just after the first if that has the same ID and value.
+  ListenerIndex::iterator lower = index.lower_bound(key);
+  size_t position = 0;
+
+  if (lower != index.begin()) {
+    --lower;
+    MicroBitListener* p = lower->second.all.back();
     newListener->next = p->next;
     p->next = newListener;
+  } else if (bucket != index.end()) {
+    newListener->next = listeners->next;
+    listeners->next = newListener;
+    position = 1;
+  } else {
+    // add at front of list
+    newListener->next = listeners;
+    listeners = newListener;
   }
 
+  // Keep the bucket in the same order.
+  ListenerBucket& b = index[key];
+  b.all.insert(b.all.begin() + position, newListener);
+  std::vector<MicroBitListener*>& typed = is_urgent(newListener) ? b.urgent : b.standard;
+  if (position == 1 && is_urgent(b.all[0]) == is_urgent(newListener))
+    typed.insert(typed.begin() + 1, newListener);
+  else
+    typed.insert(typed.begin(), newListener);
+
   MicroBitEvent(MICROBIT_ID_MESSAGE_BUS_LISTENER, newListener->id);
   return MICROBIT_OK;
 }
@@ -554,25 +747,43 @@ MicroBitMessageBus::remove(MicroBitListener* listener) {
   if (listener == NULL)
     return MICROBIT_INVALID_PARAMETER;
 
-  l = listeners;
+  // Only the buckets that this ID and VALUE (either of which may be ANY) cover need to be checked.
+  ListenerIndex& index = listener_index(this);
+  ListenerIndex::iterator it = index.begin();
+  ListenerIndex::iterator end = index.end();
+
+  if (listener->id != MICROBIT_ID_ANY) {
+    if (listener->value != MICROBIT_EVT_ANY) {
+      it = index.find(listener_key(listener->id, listener->value));
+      if (it != end) {
+        end = it;
+        ++end;
+      }
+    } else {
+      it = index.lower_bound(listener_key(listener->id, 0));
+      end = index.upper_bound(listener_key(listener->id, 0xffff));
+    }
+  }
 
-  // Walk this list of event handlers. Delete any that match the given listener.
-  while (l != NULL) {
-    if ((listener->flags & MESSAGE_BUS_LISTENER_METHOD) ==
-        (l->flags & MESSAGE_BUS_LISTENER_METHOD)) {
-      if (((listener->flags & MESSAGE_BUS_LISTENER_METHOD) &&
-           (*l->cb_method == *listener->cb_method)) ||
-          ((!(listener->flags & MESSAGE_BUS_LISTENER_METHOD) && l->cb == listener->cb))) {
-        if ((listener->id == MICROBIT_ID_ANY || listener->id == l->id) &&
-            (listener->value == MICROBIT_EVT_ANY || listener->value == l->value)) {
-          // Found a match. mark this to be removed from the list.
-          l->flags |= MESSAGE_BUS_LISTENER_DELETING;
-          removed++;
+  // Walk these event handlers. Delete any that match the given listener.
+  for (; it != end; ++it) {
+    for (size_t i = 0; i < it->second.all.size(); ++i) {
+      l = it->second.all[i];
+
+      if ((listener->flags & MESSAGE_BUS_LISTENER_METHOD) ==
+          (l->flags & MESSAGE_BUS_LISTENER_METHOD)) {
+        if (((listener->flags & MESSAGE_BUS_LISTENER_METHOD) &&
+             (*l->cb_method == *listener->cb_method)) ||
+            ((!(listener->flags & MESSAGE_BUS_LISTENER_METHOD) && l->cb == listener->cb))) {
+          if ((listener->id == MICROBIT_ID_ANY || listener->id == l->id) &&
+              (listener->value == MICROBIT_EVT_ANY || listener->value == l->value)) {
+            // Found a match. mark this to be removed from the list.
+            l->flags |= MESSAGE_BUS_LISTENER_DELETING;
+            removed++;
+          }
         }
       }
     }
-
-    l = l->next;
   }
 
   if (removed > 0)
@@ -605,6 +816,7 @@ MicroBitMessageBus::elementAt(int n) {
   * Destructor for MicroBitMessageBus, so that we deregister ourselves as an idleComponent
   */
 MicroBitMessageBus::~MicroBitMessageBus() {
+  listener_indexes().erase(this);
   // uBit.removeIdleComponent(this);
   // this should be in MicroBit::~MicroBit.
 }
@@ -0,0 +1,355 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// See MicrobitFs.h.
+
+#include "MicrobitFs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Hardware.h"
+
+namespace {
+// Where the chunks are. Chunk n (1-based, as stored in the markers) is at chunks[n - 1].
+struct fs_layout_t {
+  uint8_t* start;
+  uint8_t* last_page;
+  uint8_t* chunks;
+  size_t num_chunks;
+  bool formatted;
+};
+
+uint8_t*
+round_up(uint8_t* p) {
+  uintptr_t offset = (p - flash_rom + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+  return flash_rom + offset;
+}
+
+uint8_t*
+round_down(uint8_t* p) {
+  uintptr_t offset = (p - flash_rom) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+  return flash_rom + offset;
+}
+
+// Same calculation as init_limits() and microbit_filesystem_init() in filesystem.c. The code
+// and data take up no flash in the simulator, so the first page is the start of flash_rom.
+fs_layout_t
+get_layout() {
+  fs_layout_t layout;
+  uint8_t* first_page = flash_rom;
+  layout.last_page = round_down(flash_rom + FLASH_ROM_SIZE - MAX_SCRIPT_SIZE) - FLASH_PAGE_SIZE;
+  layout.start = first_page;
+  if (layout.last_page - first_page >
+      static_cast<ptrdiff_t>(MICROBIT_FS_MAX_CHUNKS * MICROBIT_FS_CHUNK_SIZE)) {
+    layout.start =
+        round_up(layout.last_page - MICROBIT_FS_MAX_CHUNKS * MICROBIT_FS_CHUNK_SIZE);
+  }
+  layout.num_chunks = (layout.last_page - layout.start) / MICROBIT_FS_CHUNK_SIZE;
+
+  if (layout.start[0] == MICROBIT_FS_PERSISTENT_DATA_MARKER) {
+    // The spare page is at the start, so the chunks have been shifted up by a page.
+    layout.chunks = layout.start + FLASH_PAGE_SIZE;
+    layout.formatted = true;
+  } else {
+    layout.chunks = layout.start;
+    layout.formatted = layout.last_page[0] == MICROBIT_FS_PERSISTENT_DATA_MARKER;
+  }
+  return layout;
+}
+
+uint8_t*
+get_chunk(const fs_layout_t& layout, size_t index) {
+  return layout.chunks + (index - 1) * MICROBIT_FS_CHUNK_SIZE;
+}
+
+// Erase the filesystem (flash erases to 0xff, i.e. every chunk unused) and mark the last page as
+// the spare.
+void
+format(fs_layout_t* layout) {
+  memset(layout->start, 0xff, layout->last_page + FLASH_PAGE_SIZE - layout->start);
+  layout->last_page[0] = MICROBIT_FS_PERSISTENT_DATA_MARKER;
+  layout->chunks = layout->start;
+  layout->formatted = true;
+}
+
+bool
+chunk_name_equals(const uint8_t* chunk, const std::string& name) {
+  return chunk[2] == name.size() && memcmp(chunk + 3, name.data(), name.size()) == 0;
+}
+
+// Mark every chunk of the named file (if it exists) as freed, like microbit_file_remove().
+void
+remove_file(const fs_layout_t& layout, const std::string& name) {
+  for (size_t i = 1; i <= layout.num_chunks; ++i) {
+    uint8_t* chunk = get_chunk(layout, i);
+    if (chunk[0] != MICROBIT_FS_FILE_START || !chunk_name_equals(chunk, name)) {
+      continue;
+    }
+    size_t index = i;
+    while (true) {
+      uint8_t* c = get_chunk(layout, index);
+      uint8_t next = c[MICROBIT_FS_CHUNK_SIZE - 1];
+      c[0] = MICROBIT_FS_FREED_CHUNK;
+      if (next == MICROBIT_FS_UNUSED_CHUNK || next == 0 || next > layout.num_chunks) {
+        break;
+      }
+      index = next;
+    }
+    return;
+  }
+}
+
+bool
+write_file(const fs_layout_t& layout, const std::string& name, const std::string& contents) {
+  if (name.empty() || name.size() > MICROBIT_FS_MAX_FILENAME_LENGTH) {
+    fprintf(stderr, "Skipping %s: invalid filename length.\n", name.c_str());
+    return true;
+  }
+
+  // Files are written a chunk at a time, and only move on to a new chunk when there's more data,
+  // so a file that ends exactly at the end of a chunk doesn't have an empty chunk after it.
+  size_t header = 2 + name.size();
+  size_t needed = 1;
+  if (contents.size() > MICROBIT_FS_DATA_PER_CHUNK - header) {
+    size_t rest = contents.size() - (MICROBIT_FS_DATA_PER_CHUNK - header);
+    needed += (rest + MICROBIT_FS_DATA_PER_CHUNK - 1) / MICROBIT_FS_DATA_PER_CHUNK;
+  }
+
+  remove_file(layout, name);
+
+  std::vector<size_t> indices;
+  for (size_t i = 1; i <= layout.num_chunks && indices.size() < needed; ++i) {
+    if (get_chunk(layout, i)[0] == MICROBIT_FS_UNUSED_CHUNK) {
+      indices.push_back(i);
+    }
+  }
+  if (indices.size() < needed) {
+    fprintf(stderr, "Not enough space in the filesystem for %s.\n", name.c_str());
+    return false;
+  }
+
+  size_t pos = 0;
+  size_t offset = header;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    uint8_t* chunk = get_chunk(layout, indices[i]);
+    uint8_t* data = chunk + 1;
+    if (i == 0) {
+      chunk[0] = MICROBIT_FS_FILE_START;
+      data[1] = name.size();
+      memcpy(data + 2, name.data(), name.size());
+    } else {
+      chunk[0] = indices[i - 1];
+      offset = 0;
+    }
+    size_t n = std::min(contents.size() - pos, MICROBIT_FS_DATA_PER_CHUNK - offset);
+    memcpy(data + offset, contents.data() + pos, n);
+    pos += n;
+    offset += n;
+    chunk[MICROBIT_FS_CHUNK_SIZE - 1] =
+        i + 1 < indices.size() ? indices[i + 1] : MICROBIT_FS_UNUSED_CHUNK;
+  }
+  get_chunk(layout, indices[0])[1] = offset;
+  return true;
+}
+
+bool
+read_host_file(const std::string& path, std::string* contents) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror(path.c_str());
+    return false;
+  }
+  char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    contents->append(buf, len);
+  }
+  close(fd);
+  return len == 0;
+}
+
+// Regular files in a directory, in name order (readdir's order depends on the host filesystem, and
+// the order files are written decides which chunks they get).
+bool
+import_dir(const fs_layout_t& layout, const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return false;
+  }
+  std::vector<std::string> names;
+  while (struct dirent* d = readdir(dir)) {
+    names.push_back(d->d_name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    std::string file_path = std::string(path) + "/" + names[i];
+    struct stat st;
+    if (stat(file_path.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    std::string contents;
+    if (!read_host_file(file_path, &contents) || !write_file(layout, names[i], contents)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Regular files from a (ustar, GNU or v7) tar archive. The filesystem is flat, so only the last
+// path component of each name is used. GNU long names ('L' entries) apply to the next entry.
+bool
+import_tar(const fs_layout_t& layout, const char* path) {
+  std::string archive;
+  if (!read_host_file(path, &archive)) {
+    return false;
+  }
+
+  const size_t BLOCK = 512;
+  size_t pos = 0;
+  std::string long_name;
+  while (pos + BLOCK <= archive.size()) {
+    const char* header = archive.data() + pos;
+    if (header[0] == 0) {
+      // End of archive.
+      break;
+    }
+    std::string name(header, strnlen(header, 100));
+    size_t size = strtoul(std::string(header + 124, 12).c_str(), NULL, 8);
+    char type = header[156];
+    pos += BLOCK;
+    if (pos + size > archive.size()) {
+      fprintf(stderr, "Truncated tar archive %s.\n", path);
+      return false;
+    }
+    if (type == 'L') {
+      // The data is the next entry's name (NUL-terminated).
+      long_name = std::string(archive.data() + pos, strnlen(archive.data() + pos, size));
+      pos += (size + BLOCK - 1) / BLOCK * BLOCK;
+      continue;
+    }
+    if (!long_name.empty()) {
+      name = long_name;
+      long_name.clear();
+    }
+    if (type == '0' || type == 0) {
+      size_t slash = name.rfind('/');
+      if (slash != std::string::npos) {
+        name = name.substr(slash + 1);
+      }
+      if (!write_file(layout, name, archive.substr(pos, size))) {
+        return false;
+      }
+    }
+    pos += (size + BLOCK - 1) / BLOCK * BLOCK;
+  }
+  return true;
+}
+}
+
+bool
+microbit_fs_import(const char* path) {
+  fs_layout_t layout = get_layout();
+  if (!layout.formatted) {
+    format(&layout);
+  }
+
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    perror(path);
+    return false;
+  }
+  return S_ISDIR(st.st_mode) ? import_dir(layout, path) : import_tar(layout, path);
+}
+
+bool
+microbit_fs_export(const char* dir) {
+  if (mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+    perror("filesystem export mkdir");
+    return false;
+  }
+
+  fs_layout_t layout = get_layout();
+  if (!layout.formatted) {
+    return true;
+  }
+
+  for (size_t i = 1; i <= layout.num_chunks; ++i) {
+    const uint8_t* chunk = get_chunk(layout, i);
+    if (chunk[0] != MICROBIT_FS_FILE_START) {
+      continue;
+    }
+    size_t end_offset = chunk[1];
+    size_t name_len = std::min(static_cast<size_t>(chunk[2]), MICROBIT_FS_MAX_FILENAME_LENGTH);
+    std::string name(reinterpret_cast<const char*>(chunk + 3), name_len);
+    if (name.find('/') != std::string::npos || name == "." || name == "..") {
+      continue;
+    }
+
+    // Same walk as microbit_file_size().
+    std::string contents;
+    size_t offset = 2 + name_len;
+    size_t index = i;
+    for (size_t n = 0; n < layout.num_chunks; ++n) {
+      const uint8_t* c = get_chunk(layout, index);
+      uint8_t next = c[MICROBIT_FS_CHUNK_SIZE - 1];
+      bool last = next == MICROBIT_FS_UNUSED_CHUNK || next == 0 || next > layout.num_chunks;
+      size_t end = last ? std::min(end_offset, MICROBIT_FS_DATA_PER_CHUNK)
+                        : MICROBIT_FS_DATA_PER_CHUNK;
+      if (end > offset) {
+        contents.append(reinterpret_cast<const char*>(c + 1 + offset), end - offset);
+      }
+      if (last) {
+        break;
+      }
+      offset = 0;
+      index = next;
+    }
+
+    std::string path = std::string(dir) + "/" + name;
+    int fd =
+        open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+      perror(path.c_str());
+      return false;
+    }
+    ssize_t status = write(fd, contents.data(), contents.size());
+    (void)status;
+    close(fd);
+  }
+  return true;
+}
@@ -0,0 +1,205 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "PerfCounters.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <map>
+
+bool perf_counters_enabled = false;
+uint64_t perf_counters[PERF_COUNTER_COUNT];
+
+namespace {
+const char* const COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+    "hook_calls",        "wfi_entries",
+    "timer_fires",       "code_wakeups",
+    "signal_interrupts", "code_lock_acquisitions",
+    "code_lock_wait_ns", "code_lock_hold_ns",
+};
+
+const char* const GROUP_NAMES[PERF_GROUP_COUNT] = {
+    "updates",
+    "client_events",
+};
+
+struct type_count_t {
+  uint64_t count;
+  uint64_t bytes;
+};
+
+// Per-type counts. Only touched when counters are enabled, from either thread.
+pthread_mutex_t type_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, type_count_t> type_counts[PERF_GROUP_COUNT];
+
+uint64_t start_ns = 0;
+
+void
+append_json(std::string* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void
+append_json(std::string* out, const char* format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  out->append(buf);
+}
+}
+
+void
+perf_counters_start() {
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    perf_counters[i] = 0;
+  }
+  pthread_mutex_lock(&type_counts_lock);
+  for (int i = 0; i < PERF_GROUP_COUNT; ++i) {
+    type_counts[i].clear();
+  }
+  pthread_mutex_unlock(&type_counts_lock);
+  start_ns = perf_now_ns();
+}
+
+void
+perf_count_type(PerfCounterGroup group, const char* name, size_t len, size_t bytes) {
+  if (!perf_counters_enabled) {
+    return;
+  }
+  pthread_mutex_lock(&type_counts_lock);
+  type_count_t& c = type_counts[group][std::string(name, len)];
+  c.count++;
+  c.bytes += bytes;
+  pthread_mutex_unlock(&type_counts_lock);
+}
+
+std::string
+perf_counters_json(uint64_t virtual_ms) {
+  std::string json = "{ ";
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    append_json(&json, "\"%s\": %llu, ", COUNTER_NAMES[i],
+                (unsigned long long)__atomic_load_n(&perf_counters[i], __ATOMIC_RELAXED));
+  }
+
+  uint64_t wall_ms = (perf_now_ns() - start_ns) / 1000000;
+  append_json(&json, "\"virtual_ms\": %llu, \"wall_ms\": %llu, \"virtual_wall_ratio\": %.3f",
+              (unsigned long long)virtual_ms, (unsigned long long)wall_ms,
+              wall_ms ? (double)virtual_ms / wall_ms : 0.0);
+
+  // Type names come from our own records and from handlers the client event matched, so they
+  // don't need escaping.
+  pthread_mutex_lock(&type_counts_lock);
+  for (int i = 0; i < PERF_GROUP_COUNT; ++i) {
+    append_json(&json, ", \"%s\": { ", GROUP_NAMES[i]);
+    bool first = true;
+    for (std::map<std::string, type_count_t>::const_iterator it = type_counts[i].begin();
+         it != type_counts[i].end(); ++it) {
+      json.append(first ? "\"" : ", \"");
+      json.append(it->first);
+      append_json(&json, "\": { \"count\": %llu", (unsigned long long)it->second.count);
+      // Client events are counted per handler, so there's no meaningful size for them.
+      if (i == PERF_GROUP_UPDATES) {
+        append_json(&json, ", \"bytes\": %llu", (unsigned long long)it->second.bytes);
+      }
+      json.append(" }");
+      first = false;
+    }
+    json.append(" }");
+  }
+  pthread_mutex_unlock(&type_counts_lock);
+
+  json.append(" }");
+  return json;
+}
+
+namespace {
+// Values below 8 get a bucket each. Above that, bucket by the position of the top bit and the three
+// bits below it.
+int
+latency_bucket(uint64_t us) {
+  if (us < 8) {
+    return us;
+  }
+  int top = 63 - __builtin_clzll(us);
+  return 8 + (top - 3) * 8 + ((us >> (top - 3)) & 7);
+}
+
+uint64_t
+latency_bucket_start(int bucket) {
+  if (bucket < 8) {
+    return bucket;
+  }
+  int top = (bucket - 8) / 8 + 3;
+  return (8ull | ((bucket - 8) % 8)) << (top - 3);
+}
+}
+
+void
+latency_histogram_add(latency_histogram_t* h, uint64_t us) {
+  if (us >= (1ull << 32)) {
+    us = (1ull << 32) - 1;
+  }
+  h->buckets[latency_bucket(us)]++;
+  h->count++;
+  if (us > h->max_us) {
+    h->max_us = us;
+  }
+}
+
+uint64_t
+latency_histogram_percentile(const latency_histogram_t* h, uint32_t p) {
+  if (h->count == 0) {
+    return 0;
+  }
+  // The rank of the sample we want (1-based, rounding up).
+  uint64_t rank = (h->count * p + 99) / 100;
+  if (rank == 0) {
+    rank = 1;
+  }
+  if (rank >= h->count) {
+    return h->max_us;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t start = latency_bucket_start(i);
+      return start < h->max_us ? start : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+std::string
+latency_histogram_json(const latency_histogram_t* h) {
+  std::string json;
+  append_json(&json, "{ \"count\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu }",
+              (unsigned long long)h->count,
+              (unsigned long long)latency_histogram_percentile(h, 50),
+              (unsigned long long)latency_histogram_percentile(h, 99),
+              (unsigned long long)h->max_us);
+  return json;
+}
@@ -0,0 +1,153 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "PythonProfiler.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+extern "C" {
+// Simple JSON library.
+#include "buffer.h"
+#include "json.h"
+}
+
+bool profiler_enabled = false;
+bool profiler_sample_due = false;
+
+namespace {
+// Deeper stacks keep their innermost frames (under a "[truncated]" root).
+const size_t MAX_FRAMES = 64;
+// Samples with stacks beyond this many distinct ones are counted as "[other]".
+const size_t MAX_STACKS = 10000;
+
+uint32_t sample_interval = 1;
+uint32_t next_sample_ticks = 0;
+
+uint64_t samples = 0;
+uint64_t idle_samples = 0;
+std::map<std::string, uint64_t> folded_stacks;
+
+// Reused between samples to avoid allocating.
+std::string stack;
+
+bool
+compare_counts(const std::pair<std::string, uint64_t>& a,
+               const std::pair<std::string, uint64_t>& b) {
+  return a.second > b.second;
+}
+}
+
+bool
+profiler_start(uint32_t interval) {
+  if (!simulated_dal_micropy_profile_stack) {
+    return false;
+  }
+  sample_interval = interval ? interval : 1;
+  next_sample_ticks = 0;
+  profiler_enabled = true;
+  return true;
+}
+
+void
+profiler_tick(uint32_t macro_ticks, bool vm_waiting) {
+  if (macro_ticks < next_sample_ticks) {
+    return;
+  }
+  next_sample_ticks = macro_ticks + sample_interval;
+  if (vm_waiting) {
+    profiler_sample(true);
+  } else {
+    profiler_sample_due = true;
+  }
+}
+
+void
+profiler_sample(bool idle) {
+  profiler_sample_due = false;
+
+  simulated_dal_frame_t frames[MAX_FRAMES];
+  size_t n = simulated_dal_micropy_profile_stack(frames, MAX_FRAMES);
+  if (n > MAX_FRAMES) {
+    n = MAX_FRAMES;
+  }
+
+  stack.clear();
+  if (n == MAX_FRAMES) {
+    stack = "[truncated]";
+  } else if (n == 0) {
+    // e.g. compiling, or in the REPL.
+    stack = "[no python]";
+  }
+  for (size_t i = n; i-- > 0;) {
+    char frame[256];
+    snprintf(frame, sizeof(frame), "%s (%s:%u)", frames[i].function ? frames[i].function : "?",
+             frames[i].file ? frames[i].file : "?", frames[i].line);
+    if (!stack.empty()) {
+      stack += ';';
+    }
+    stack += frame;
+  }
+  if (idle) {
+    stack += ";[wfi]";
+    ++idle_samples;
+  }
+  ++samples;
+
+  std::map<std::string, uint64_t>::iterator it = folded_stacks.find(stack);
+  if (it != folded_stacks.end()) {
+    it->second++;
+  } else if (folded_stacks.size() < MAX_STACKS) {
+    folded_stacks[stack] = 1;
+  } else {
+    folded_stacks["[other]"]++;
+  }
+}
+
+std::string
+profiler_json() {
+  std::vector<std::pair<std::string, uint64_t> > sorted(folded_stacks.begin(),
+                                                        folded_stacks.end());
+  std::stable_sort(sorted.begin(), sorted.end(), &compare_counts);
+
+  struct buffer* json = buffer_create();
+  buffer_append_printf(json,
+                       "{ \"interval_ticks\": %u, \"samples\": %llu, \"idle_samples\": %llu, "
+                       "\"stacks\": [",
+                       sample_interval, (unsigned long long)samples,
+                       (unsigned long long)idle_samples);
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    buffer_append(json, i ? ", { \"stack\": " : " { \"stack\": ");
+    json_write_escape_string(json, sorted[i].first.c_str());
+    buffer_append_printf(json, ", \"count\": %llu }", (unsigned long long)sorted[i].second);
+  }
+  buffer_append(json, " ] }");
+
+  std::string result(json->data, json->nbytes_used);
+  buffer_destroy(json);
+  return result;
+}
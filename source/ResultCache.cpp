@@ -0,0 +1,378 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// See ResultCache.h.
+
+#include "ResultCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace {
+std::string cache_dir;
+uint64_t cache_max_bytes = 0;
+
+// The capture file (inherited by every run), and serial output waiting to be written as a single
+// chunk. Protected by capture_lock.
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+int capture_fd = -1;
+std::string capture_path;
+std::string capture_key;
+std::string capture_stdout;
+
+// Chunks are written with a single write() to an O_APPEND file, so they never interleave.
+void
+write_chunk(int fd, ResultCacheStream stream, const void* buf, size_t len) {
+  std::string chunk;
+  uint8_t s = stream;
+  uint32_t n = len;
+  chunk.append(reinterpret_cast<const char*>(&s), sizeof(s));
+  chunk.append(reinterpret_cast<const char*>(&n), sizeof(n));
+  chunk.append(static_cast<const char*>(buf), len);
+  ssize_t status = write(fd, chunk.data(), chunk.size());
+  (void)status;
+}
+
+// Caller must hold capture_lock.
+void
+flush_capture_stdout() {
+  if (!capture_stdout.empty()) {
+    write_chunk(capture_fd, RESULT_CACHE_STDOUT, capture_stdout.data(), capture_stdout.size());
+    capture_stdout.clear();
+  }
+}
+
+std::string
+entry_path(const char* key) {
+  return cache_dir + "/" + key + ".out";
+}
+
+// Update the hit/miss/store/eviction counters in <dir>/stats.json.
+void
+update_stats(int hits, int misses, int stores, int evictions) {
+  std::string path = cache_dir + "/stats.json";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    return;
+  }
+  flock(fd, LOCK_EX);
+
+  char buf[1024] = {0};
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  unsigned long long h = 0, m = 0, s = 0, e = 0;
+  if (len > 0) {
+    sscanf(buf, "{\"hits\": %llu, \"misses\": %llu, \"stores\": %llu, \"evictions\": %llu", &h,
+           &m, &s, &e);
+  }
+  h += hits;
+  m += misses;
+  s += stores;
+  e += evictions;
+
+  len = snprintf(buf, sizeof(buf),
+                 "{\"hits\": %llu, \"misses\": %llu, \"stores\": %llu, \"evictions\": %llu, "
+                 "\"hit_rate\": %.4f}\n",
+                 h, m, s, e, (h + m) ? static_cast<double>(h) / (h + m) : 0.0);
+  if (ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0) {
+    ssize_t status = write(fd, buf, len);
+    (void)status;
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+struct entry_t {
+  std::string path;
+  uint64_t size;
+  struct timespec mtime;
+};
+
+bool
+entry_older(const entry_t& a, const entry_t& b) {
+  if (a.mtime.tv_sec != b.mtime.tv_sec) {
+    return a.mtime.tv_sec < b.mtime.tv_sec;
+  }
+  return a.mtime.tv_nsec < b.mtime.tv_nsec;
+}
+
+// Remove the least recently used entries (hits touch the mtime) until the cache fits in
+// cache_max_bytes. Returns the number of entries removed.
+int
+evict() {
+  DIR* dir = opendir(cache_dir.c_str());
+  if (!dir) {
+    return 0;
+  }
+
+  std::vector<entry_t> entries;
+  uint64_t total = 0;
+  while (struct dirent* d = readdir(dir)) {
+    size_t name_len = strlen(d->d_name);
+    if (name_len < 4 || strcmp(d->d_name + name_len - 4, ".out") != 0) {
+      continue;
+    }
+    entry_t e;
+    e.path = cache_dir + "/" + d->d_name;
+    struct stat st;
+    if (stat(e.path.c_str(), &st) == -1) {
+      continue;
+    }
+    e.size = st.st_size;
+    e.mtime = st.st_mtim;
+    total += e.size;
+    entries.push_back(e);
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end(), entry_older);
+
+  int evicted = 0;
+  for (size_t i = 0; i < entries.size() && total > cache_max_bytes; ++i) {
+    if (unlink(entries[i].path.c_str()) == 0) {
+      total -= entries[i].size;
+      ++evicted;
+    }
+  }
+  return evicted;
+}
+
+int
+find_build_id(struct dl_phdr_info* info, size_t size, void* data) {
+  sha256_t* ctx = static_cast<sha256_t*>(data);
+  // The first object is the executable itself.
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_NOTE) {
+      continue;
+    }
+    const char* p = reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+    const char* end = p + phdr.p_memsz;
+    while (p + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr)* note = reinterpret_cast<const ElfW(Nhdr)*>(p);
+      const char* name = p + sizeof(ElfW(Nhdr));
+      const char* desc = name + ((note->n_namesz + 3) & ~3);
+      if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+        sha256_update(ctx, desc, note->n_descsz);
+        return 1;
+      }
+      p = desc + ((note->n_descsz + 3) & ~3);
+    }
+  }
+  return -1;
+}
+}
+
+void
+result_cache_hash_build_id(sha256_t* ctx) {
+  if (dl_iterate_phdr(&find_build_id, ctx) == 1) {
+    return;
+  }
+
+  // No build ID note, so identify the firmware by its contents.
+  int fd = open("/proc/self/exe", O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  char buf[65536];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    sha256_update(ctx, buf, len);
+  }
+  close(fd);
+}
+
+bool
+result_cache_init(const char* dir, uint64_t max_bytes) {
+  if (mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+    perror("result cache mkdir");
+    return false;
+  }
+  cache_dir = dir;
+  cache_max_bytes = max_bytes;
+  return true;
+}
+
+bool
+result_cache_replay(const char* key, int updates_fd, int* status) {
+  int fd = open(entry_path(key).c_str(), O_RDONLY);
+  if (fd == -1) {
+    update_stats(0, 1, 0, 0);
+    return false;
+  }
+
+  // Read the whole entry first, so that an incomplete one can be treated as a miss.
+  std::string entry;
+  char buf[65536];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    entry.append(buf, len);
+  }
+
+  // Find the status chunk (which marks the entry as complete).
+  size_t pos = 0;
+  bool complete = false;
+  while (pos + 5 <= entry.size()) {
+    uint8_t stream = entry[pos];
+    uint32_t n;
+    memcpy(&n, entry.data() + pos + 1, sizeof(n));
+    if (pos + 5 + n > entry.size()) {
+      break;
+    }
+    if (stream == RESULT_CACHE_STATUS && n == sizeof(int32_t)) {
+      int32_t s;
+      memcpy(&s, entry.data() + pos + 5, sizeof(s));
+      *status = s;
+      complete = true;
+      break;
+    }
+    pos += 5 + n;
+  }
+
+  if (!complete) {
+    close(fd);
+    update_stats(0, 1, 0, 0);
+    return false;
+  }
+
+  // Mark as recently used.
+  futimens(fd, NULL);
+  close(fd);
+
+  pos = 0;
+  while (pos + 5 <= entry.size()) {
+    uint8_t stream = entry[pos];
+    uint32_t n;
+    memcpy(&n, entry.data() + pos + 1, sizeof(n));
+    const char* data = entry.data() + pos + 5;
+    if (stream == RESULT_CACHE_UPDATES) {
+      size_t written = 0;
+      while (written < n) {
+        ssize_t w = write(updates_fd, data + written, n - written);
+        if (w == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          break;
+        }
+        written += w;
+      }
+    } else if (stream == RESULT_CACHE_STDOUT) {
+      fwrite(data, 1, n, stdout);
+      fflush(stdout);
+    } else if (stream == RESULT_CACHE_STATUS) {
+      break;
+    }
+    pos += 5 + n;
+  }
+
+  update_stats(1, 0, 0, 0);
+  return true;
+}
+
+bool
+result_cache_begin(const char* key) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp.%d", getpid());
+  capture_key = key;
+  capture_path = cache_dir + "/" + key + suffix;
+  capture_fd = open(capture_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (capture_fd == -1) {
+    perror("result cache capture");
+    return false;
+  }
+  return true;
+}
+
+bool
+result_cache_capturing() {
+  return capture_fd != -1;
+}
+
+void
+result_cache_capture(ResultCacheStream stream, const void* buf, size_t len) {
+  if (capture_fd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&capture_lock);
+  if (stream == RESULT_CACHE_STDOUT) {
+    // Serial output arrives a byte at a time, so collect it into larger chunks.
+    capture_stdout.append(static_cast<const char*>(buf), len);
+    if (capture_stdout.size() >= 4096) {
+      flush_capture_stdout();
+    }
+  } else {
+    flush_capture_stdout();
+    write_chunk(capture_fd, stream, buf, len);
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+void
+result_cache_flush() {
+  if (capture_fd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&capture_lock);
+  flush_capture_stdout();
+  pthread_mutex_unlock(&capture_lock);
+}
+
+void
+result_cache_end(bool store, int status) {
+  if (capture_fd == -1) {
+    return;
+  }
+
+  result_cache_flush();
+
+  int evicted = 0;
+  if (store) {
+    int32_t s = status;
+    write_chunk(capture_fd, RESULT_CACHE_STATUS, &s, sizeof(s));
+  }
+  close(capture_fd);
+  capture_fd = -1;
+
+  if (store && rename(capture_path.c_str(), entry_path(capture_key.c_str()).c_str()) == 0) {
+    evicted = evict();
+    update_stats(0, 0, 1, evicted);
+  } else {
+    unlink(capture_path.c_str());
+  }
+}
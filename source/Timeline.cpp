@@ -0,0 +1,181 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Grok Learning
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "Timeline.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+bool timeline_enabled = false;
+
+namespace {
+struct span_t {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+};
+
+// Each thread only appends to its own buffer. The list of buffers is only locked when a thread
+// records its first span.
+struct thread_buffer_t {
+  pid_t tid;
+  const char* name;
+  std::vector<span_t> spans;
+  // Spans not recorded because the buffer was full.
+  uint64_t dropped;
+};
+
+// At most 24MB per thread.
+const size_t MAX_SPANS_PER_THREAD = 1 << 20;
+
+pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<thread_buffer_t*> buffers;
+thread_local thread_buffer_t* current_buffer = nullptr;
+
+int timeline_fd = -1;
+
+thread_buffer_t*
+get_thread_buffer() {
+  if (!current_buffer) {
+    current_buffer = new thread_buffer_t();
+    current_buffer->tid = syscall(SYS_gettid);
+    current_buffer->name = nullptr;
+    current_buffer->dropped = 0;
+    current_buffer->spans.reserve(4096);
+    pthread_mutex_lock(&buffers_lock);
+    buffers.push_back(current_buffer);
+    pthread_mutex_unlock(&buffers_lock);
+  }
+  return current_buffer;
+}
+
+bool
+write_all(const std::string& data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t n = write(timeline_fd, data.data() + offset, data.size() - offset);
+    if (n <= 0) {
+      perror("write timeline");
+      return false;
+    }
+    offset += n;
+  }
+  return true;
+}
+
+void
+append_event(std::string* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void
+append_event(std::string* out, const char* format, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  out->append(buf);
+}
+}
+
+bool
+timeline_open(const char* path) {
+  timeline_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (timeline_fd == -1) {
+    perror("open timeline");
+    return false;
+  }
+  // Events are written as they're flushed, so the array is never closed (which the trace event
+  // format allows).
+  if (!write_all("[\n")) {
+    return false;
+  }
+  timeline_enabled = true;
+  return true;
+}
+
+void
+timeline_thread_name(const char* name) {
+  if (timeline_enabled) {
+    get_thread_buffer()->name = name;
+  }
+}
+
+void
+timeline_span(const char* name, uint64_t start_ns, uint64_t end_ns) {
+  thread_buffer_t* buffer = get_thread_buffer();
+  if (buffer->spans.size() >= MAX_SPANS_PER_THREAD) {
+    buffer->dropped++;
+    return;
+  }
+  buffer->spans.push_back({name, start_ns, end_ns});
+}
+
+void
+timeline_write(uint32_t run) {
+  if (!timeline_enabled) {
+    return;
+  }
+
+  int pid = getpid();
+  std::string out;
+  append_event(&out,
+               "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": { \"name\": "
+               "\"simulator run %u\" }},\n",
+               pid, run);
+
+  pthread_mutex_lock(&buffers_lock);
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    thread_buffer_t* buffer = buffers[i];
+    append_event(&out,
+                 "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": { "
+                 "\"name\": \"%s\", \"dropped_spans\": %llu }},\n",
+                 pid, buffer->tid, buffer->name ? buffer->name : "thread",
+                 (unsigned long long)buffer->dropped);
+    for (size_t j = 0; j < buffer->spans.size(); ++j) {
+      const span_t& span = buffer->spans[j];
+      // Timestamps are in microseconds.
+      append_event(&out,
+                   "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, "
+                   "\"dur\": %.3f},\n",
+                   span.name, pid, buffer->tid, span.start_ns / 1000.0,
+                   (span.end_ns - span.start_ns) / 1000.0);
+      if (out.size() >= 65536) {
+        write_all(out);
+        out.clear();
+      }
+    }
+    buffer->spans.clear();
+    buffer->dropped = 0;
+  }
+  pthread_mutex_unlock(&buffers_lock);
+
+  write_all(out);
+}
@@ -123,9 +123,12 @@ fire_ticker(uint32_t ticks_since_last_call) {
 
   if (_ticks >= _timer_ticks[3]) {
     ++_macro_ticks;
+    ::ticks = _macro_ticks * 6;
     if (_slow_callback_enabled) {
       _slow_callback();
     }
+    // Wake any fibers whose fiber_sleep() has expired.
+    scheduler_tick();
     _timer_ticks[3] += 375;
   }
   for (int i = 0; i < 3; ++i) {
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Measure the memory used by idle simulators, to see how many fit per GB:
+#   utils/bench-density.sh <simulator> [<baseline simulator>]
+# Starts SIMS simulators (default 50) each running a script that just sleeps, waits SETTLE seconds
+# (default 3), then sums the proportional (PSS) and resident (RSS) set sizes of each simulator's
+# processes (the parent and the child running the VM). PSS shares pages between the simulators that
+# use them, so it's the better measure of how many fit. Pass a second simulator (e.g. built from an
+# earlier commit) to compare before and after.
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+  echo "Usage: $0 <simulator> [<baseline simulator>]" >&2
+  exit 1
+fi
+
+SIMS=${SIMS:-50}
+SETTLE=${SETTLE:-3}
+
+WORKDIR=$(mktemp -d)
+trap "pkill -P $$; rm -rf $WORKDIR" EXIT
+
+cat > $WORKDIR/idle.py <<PYTHON
+from microbit import *
+while True:
+    sleep(1000)
+PYTHON
+
+# Prints the total PSS and RSS (in kB) of a process and its children.
+memory_kb() {
+  local PIDS="$1 $(pgrep -P $1)"
+  for PID in $PIDS; do
+    cat /proc/$PID/smaps_rollup 2>/dev/null
+  done | awk '/^Pss:/ { pss += $2 } /^Rss:/ { rss += $2 } END { print pss, rss }'
+}
+
+measure() {
+  local NAME=$1
+  local SIMULATOR=$(cd $(dirname $2); pwd)/$(basename $2)
+  local PIDS=
+  for SIM in $(seq $SIMS); do
+    mkdir -p $WORKDIR/$NAME/$SIM
+    # Each simulator gets its own directory for ___device_updates and ___client_events.
+    (cd $WORKDIR/$NAME/$SIM && exec $SIMULATOR ../../idle.py > /dev/null 2>&1 < /dev/null) &
+    PIDS="$PIDS $!"
+  done
+  sleep $SETTLE
+
+  for PID in $PIDS; do
+    memory_kb $PID
+  done | awk -v name=$NAME -v sims=$SIMS '
+    { pss += $1; rss += $2 }
+    END {
+      printf "%s: %.0f kB PSS (%.0f kB RSS) per sim, ~%.0f sims per GB\n", name, pss / sims,
+             rss / sims, (pss > 0 ? 1024 * 1024 * sims / pss : 0)
+    }'
+
+  kill $PIDS 2> /dev/null
+  wait 2> /dev/null
+}
+
+if [ $# -eq 2 ]; then
+  measure baseline $2
+fi
+measure simulator $1
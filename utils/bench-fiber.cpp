@@ -0,0 +1,81 @@
+// Microbenchmarks for the host fiber scheduler (source/MicroBitFiber.cpp).
+// Build and run from the repository root (needs the microbit-dal headers linked into inc/):
+//   g++ -O2 -std=gnu++11 -Iinc -Iinc/mbed utils/bench-fiber.cpp source/MicroBitFiber.cpp
+//     -o /tmp/bench-fiber && /tmp/bench-fiber
+// Reports the cost of a fiber context switch (a fiber yielding to the main fiber and back),
+// invoke() of a handler that doesn't block, and invoke() of a handler that blocks once.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "MicroBitFiber.h"
+
+namespace {
+const int ITERATIONS = 1000000;
+
+int remaining = 0;
+
+// The main fiber only idles in fiber_sleep/fiber_wait_for_event, which this doesn't use.
+void
+yield_loop() {
+  while (remaining > 0) {
+    --remaining;
+    schedule();
+  }
+}
+
+void
+noop_handler(void*) {
+}
+
+void
+blocking_handler(void*) {
+  // Blocks once (the caller carries on), then finishes when the main fiber next schedules.
+  schedule();
+}
+
+double
+now_ns() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void
+report(const char* name, double start, int n) {
+  printf("%-24s %8.1f ns\n", name, (now_ns() - start) / n);
+}
+}
+
+void
+__wait_for_interrupt() {
+}
+
+int
+main() {
+  scheduler_init();
+
+  // Each schedule() from main runs the fiber until it yields back: two switches.
+  remaining = ITERATIONS;
+  create_fiber(yield_loop);
+  double start = now_ns();
+  while (!scheduler_runqueue_empty()) {
+    schedule();
+  }
+  report("context switch", start, ITERATIONS * 2);
+
+  start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    invoke(noop_handler, NULL);
+  }
+  report("invoke (non-blocking)", start, ITERATIONS);
+
+  start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    invoke(blocking_handler, NULL);
+    schedule();
+  }
+  report("invoke (blocking)", start, ITERATIONS);
+
+  return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Compare the threaded and single-threaded (-S) simulator modes with many concurrent simulators:
+#   utils/bench-single-threaded.sh build/x86-linux-native-32bit/source/microbit-micropython
+# Runs SIMS simulators at once in each mode, each running a script that animates the display in
+# real time for about DURATION seconds, and reports context switches per simulator and how many
+# simulators one core could sustain (wall time / CPU time). Needs GNU time (/usr/bin/time).
+
+if [ $# -ne 1 ]; then
+  echo "Usage: $0 <simulator>" >&2
+  exit 1
+fi
+
+SIMULATOR=$(cd $(dirname $1); pwd)/$(basename $1)
+SIMS=${SIMS:-50}
+DURATION=${DURATION:-5}
+
+WORKDIR=$(mktemp -d)
+trap "rm -rf $WORKDIR" EXIT
+
+cat > $WORKDIR/bench.py <<PYTHON
+from microbit import *
+start = running_time()
+i = 0
+while running_time() - start < $DURATION * 1000:
+    display.set_pixel(i % 5, (i // 5) % 5, i % 10)
+    i += 1
+    sleep(10)
+PYTHON
+
+for MODE in threaded single; do
+  FLAGS=
+  if [ $MODE = single ]; then
+    FLAGS=-S
+  fi
+  for SIM in $(seq $SIMS); do
+    mkdir -p $WORKDIR/$MODE/$SIM
+    # Each simulator gets its own directory for ___device_updates and ___client_events.
+    (cd $WORKDIR/$MODE/$SIM && /usr/bin/time -o time.txt -f "%e %U %S %w %c" \
+       $SIMULATOR $FLAGS ../../bench.py > /dev/null 2>&1) &
+  done
+  wait
+
+  cat $WORKDIR/$MODE/*/time.txt | awk -v mode=$MODE -v sims=$SIMS '
+    { wall += $1; cpu += $2 + $3; voluntary += $4; involuntary += $5 }
+    END {
+      printf "%s: %.0f voluntary + %.0f involuntary context switches per sim, ", mode,
+             voluntary / sims, involuntary / sims
+      printf "%.1f%% CPU per sim, ~%.0f sims per core\n", 100 * cpu / wall,
+             (cpu > 0 ? wall / cpu : 0)
+    }'
+done
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compare VM throughput between two builds of the simulator, e.g. the 32-bit and 64-bit targets:
+#   utils/bench-targets.sh build/x86-linux-native-32bit/source/microbit-micropython \
+#                          build/x86_64-linux-native/source/microbit-micropython
+# Each build runs a CPU-bound script RUNS times (deterministic mode, so no time is spent waiting
+# for the clock) and the best time is reported as loop iterations per second.
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 <simulator> [<simulator>...]" >&2
+  exit 1
+fi
+
+ITERATIONS=${ITERATIONS:-200000}
+RUNS=${RUNS:-5}
+
+WORKDIR=$(mktemp -d)
+trap "rm -rf $WORKDIR" EXIT
+
+cat > $WORKDIR/bench.py <<PYTHON
+from microbit import *
+total = 0
+values = [3, 1, 4, 1, 5, 9, 2, 6]
+for i in range($ITERATIONS):
+    total = (total + values[i % 8] * i) % 1000003
+print(total)
+PYTHON
+
+for SIMULATOR in "$@"; do
+  SIMULATOR=$(cd $(dirname $SIMULATOR); pwd)/$(basename $SIMULATOR)
+  BEST=
+  for RUN in $(seq $RUNS); do
+    START=$(date +%s%N)
+    (cd $WORKDIR && $SIMULATOR -s 0 bench.py > /dev/null 2>&1)
+    END=$(date +%s%N)
+    ELAPSED=$(( (END - START) / 1000 ))
+    if [ -z "$BEST" ] || [ $ELAPSED -lt $BEST ]; then
+      BEST=$ELAPSED
+    fi
+  done
+  echo "$SIMULATOR: best of $RUNS ${BEST}us, $(( ITERATIONS * 1000000 / BEST )) iterations/s"
+done
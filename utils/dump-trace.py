@@ -0,0 +1,41 @@
+#!/usr/bin/python3
+
+# vim: set et nosi ai ts=2 sts=2 sw=2:
+# coding: utf-8
+
+# Print an input trace recorded with `microbit-micropython -r <trace>` as text, one record per line.
+
+from __future__ import absolute_import, print_function, unicode_literals
+
+import struct
+import sys
+
+KINDS = {0: 'run', 1: 'serial', 2: 'events', 3: 'scheduled', 4: 'end'}
+
+
+def main(path):
+  with open(path, 'rb') as f:
+    magic, version, flags, seed = struct.unpack('=4sIII', f.read(16))
+    if magic != b'MBTR' or version != 1:
+      print('Not a valid input trace: {}'.format(path), file=sys.stderr)
+      return 1
+    print('deterministic={} seed={}'.format(bool(flags & 1), seed))
+    while True:
+      header = f.read(9)
+      if len(header) < 9:
+        break
+      ticks, kind, length = struct.unpack('=IBI', header)
+      payload = f.read(length)
+      if kind == 1:
+        payload = repr(payload)
+      else:
+        payload = payload.decode('utf-8')
+      print('{:>8} {:<9} {}'.format(ticks, KINDS.get(kind, kind), payload))
+  return 0
+
+
+if __name__ == '__main__':
+  if len(sys.argv) != 2:
+    print('Usage: {} <trace>'.format(sys.argv[0]), file=sys.stderr)
+    sys.exit(1)
+  sys.exit(main(sys.argv[1]))